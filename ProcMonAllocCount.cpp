@@ -0,0 +1,23 @@
+// ProcMonAllocCount - heap allocation counter for ProcMonBench (C++17)
+// Author / Maintainer: Bob Paydar
+//
+// Replaces the global operator new/delete with malloc/free plus a relaxed counter,
+// so the benchmark can report allocations per row. It changes the allocator of
+// every program it is linked into, which is why only ProcMonBench links it: the
+// engine library and ProcMonUI keep the default allocator. operator new[] and the
+// nothrow forms forward to these.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+std::atomic<uint64_t> g_allocCount{ 0 };
+
+void* operator new(size_t n) {
+    g_allocCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
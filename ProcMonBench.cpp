@@ -0,0 +1,210 @@
+// ProcMonBench - reproducible benchmarks for the ProcMonEngine stages (console, C++17)
+// Author / Maintainer: Bob Paydar
+//
+//   ProcMonBench [--rows <n>]... [--live] [--min-ms <ms>]
+//
+// Every stage runs against synthetic process tables of 1k, 10k and 100k rows (or the
+// --rows given), generated from a fixed seed so each run measures the same data;
+// --live adds the running system (and the enumeration itself). A stage repeats until
+// it has run --min-ms (default 300) and at least 3 times, after one warm-up run, and
+// reports the mean ns per row and heap allocations per row (ProcMonAllocCount.cpp,
+// linked only into this program, counts operator new).
+//
+// Stages:
+//   snapshot      Snapshot() with every path, live table only (path cache warm, as on a refresh)
+//   diff          DiffSnapshots() between two tables with ~30% of the rows changed
+//   tree          BuildProcTree()
+//   filter        StringFilter::Narrow() over every row with a new needle (cold cache)
+//   match-sse2    ContainsFolded() on each row's name and path, no per-string cache
+//   match-tolower the matcher it replaced: ToLower copies of both strings + find()
+//   json/csv/pms  WriteJson() / WriteCsv() / WriteSnapshot() into memory
+//   history       RecordHistory() of kHistoryFrames frames alternating between two tables
+//                 (the diff's ~30% changed rows); also prints the encoded bytes per frame
+//
+// Build: the ProcMonBench target in CMakeLists.txt, or console subsystem,
+// ProcMonBench.cpp + ProcMonEngine.cpp + ProcMonAllocCount.cpp (see README).
+
+#include "ProcMonEngine.h"
+
+#include <cstdio>
+#include <random>
+
+static double g_minMs = 300;
+extern std::atomic<uint64_t> g_allocCount; // ProcMonAllocCount.cpp
+
+struct Result { double nsPerRow, allocsPerRow; uint64_t runs; };
+
+template <class Fn>
+static Result Measure(size_t rows, const Fn& fn) {
+    fn(); // warm-up: caches and capacities, as in steady state
+    const uint64_t a0 = g_allocCount.load();
+    const int64_t t0 = QpcNow();
+    uint64_t runs = 0;
+    double ms = 0;
+    do { fn(); ++runs; ms = TicksToMs(QpcNow() - t0); } while (runs < 3 || ms < g_minMs);
+    const double per = (double)runs * (double)std::max<size_t>(rows, 1);
+    return Result{ ms * 1e6 / per, (double)(g_allocCount.load() - a0) / per, runs };
+}
+static void Report(const char* table, const char* stage, size_t rows, const Result& r) {
+    printf("%-8s %-14s %8u %12.1f %12.3f %8llu\n", table, stage, (unsigned)rows, r.nsPerRow, r.allocsPerRow, (unsigned long long)r.runs);
+}
+
+// A build host's mix: a few image names shared by many processes, long agent paths
+// (one work folder per ~16 processes), and a random forest of parents, each older
+// than its children.
+static std::vector<Proc> SyntheticTable(size_t n, uint32_t seed) {
+    static const wchar_t* const names[] = {
+        L"svchost.exe", L"msbuild.exe", L"cl.exe", L"link.exe", L"conhost.exe", L"node.exe", L"python.exe", L"git.exe",
+        L"Agent.Worker.exe", L"mspdbsrv.exe", L"dotnet.exe", L"cmd.exe", L"powershell.exe", L"RuntimeBroker.exe", L"vctip.exe", L"csc.exe",
+    };
+    const size_t kinds = sizeof(names) / sizeof(names[0]);
+    std::mt19937 rng(seed);
+    std::vector<Proc> v(n);
+    for (size_t i = 0; i < n; ++i) {
+        Proc& p = v[i];
+        p.pid = (DWORD)(4 * (i + 1));
+        p.ppid = i && rng() % 8 ? v[rng() % i].pid : 0;
+        p.created = 133000000000000000ull + i * 10000;
+        const wchar_t* name = names[rng() % kinds];
+        p.name = g_strings.Intern(name);
+        const std::wstring path = L"C:\\ProgramData\\BuildAgent\\_work\\" + std::to_wstring(rng() % (n / 16 + 1)) +
+            L"\\s\\packages\\toolset.2.4.1\\tools\\bin\\x64\\" + name;
+        p.path = g_strings.Intern(path);
+        p.rss = (SIZE_T)(rng() % 65536 + 16) << 12;
+        p.cpuTime = rng() % 100000000;
+        p.privateBytes = p.rss / 2;
+        p.commit = p.rss;
+    }
+    return v;
+}
+// `v` one refresh later: ~30% of the rows changed counters (a third of those with I/O),
+// ~1% restarted under the same PID.
+static std::vector<Proc> NextTable(const std::vector<Proc>& v, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<Proc> w = v;
+    for (Proc& p : w) {
+        const uint32_t r = rng() % 100;
+        if (r < 30) {
+            p.rss += 4096; p.privateBytes += 4096; p.commit += 4096; p.cpuTime += 156250; p.pageFaults += 40;
+            if (r < 10) { p.readBytes += 32 << 10; p.writeBytes += 8 << 10; }
+        }
+        else if (r == 30) p.created += 1;
+    }
+    return w;
+}
+
+// RecordHistory() over kHistoryFrames frames from a fresh keyframe, then the size of
+// the log. Small enough to stay under the in-memory budget at 100k rows (no spill).
+static const int kHistoryFrames = 32;
+static void RunHistory(const char* table, const std::vector<Proc>& a, const std::vector<Proc>& b, double cores) {
+    const size_t n = a.size();
+    std::vector<Proc> x = a, y = b;
+    SampleByKey prev, scratch;
+    SnapshotDiff seed, ab, ba;
+    DiffSnapshots(prev, scratch, x, seed, 0, cores);
+    DiffSnapshots(prev, scratch, y, ab, 1.0, cores);
+    DiffSnapshots(prev, scratch, x, ba, 1.0, cores);
+    const Result r = Measure(n * kHistoryFrames, [&] {
+        SetRecording(true); // drops the previous run's log at the next keyframe
+        RecordHistory(x, seed);
+        for (int i = 0; i < kHistoryFrames; ++i) RecordHistory(i & 1 ? x : y, i & 1 ? ba : ab);
+    });
+    Report(table, "history", n, r);
+    std::vector<Proc> key;
+    HistoryLog log;
+    if (CopyHistory(key, log) && log.frames) {
+        const double perFrame = (double)log.bytes.size() / log.frames;
+        printf("%-8s %-14s %8u %12.0f bytes/frame, %.2f KB per 1k rows, %.1f MB/h at 1 s\n", table, "history", (unsigned)n,
+            perFrame, perFrame * 1000 / std::max<size_t>(n, 1) / 1024, perFrame * 3600 / (1024 * 1024));
+    }
+    SetRecording(false);
+}
+
+static void RunStages(const char* table, std::vector<Proc>& v) {
+    const size_t n = v.size();
+    const double cores = std::max<DWORD>(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS), 1);
+
+    std::vector<Proc> a = v, b = NextTable(v, 2);
+    SampleByKey prev, scratch;
+    SnapshotDiff d;
+    bool flip = false;
+    Report(table, "diff", n, Measure(n, [&] {
+        flip = !flip;
+        DiffSnapshots(prev, scratch, flip ? b : a, d, 1.0, cores);
+    }));
+
+    std::vector<uint32_t> order(n), rows;
+    for (uint32_t i = 0; i < (uint32_t)n; ++i) order[i] = i;
+    ProcTree t;
+    Report(table, "tree", n, Measure(n, [&] { BuildProcTree(v, order, t); }));
+
+    const std::wstring needle = ToLower(L"Agent.W");
+    rows.reserve(n);
+    Report(table, "filter", n, Measure(n, [&] {
+        StringFilter f;
+        f.SetNeedle(needle);
+        rows.clear();
+        f.Narrow(v, order, rows);
+    }));
+    size_t hits = 0;
+    Report(table, "match-sse2", n, Measure(n, [&] {
+        for (const Proc& p : v) {
+            const std::wstring_view s = g_strings.Folded(p.name), q = g_strings.Folded(p.path);
+            hits += ContainsFolded(s.data(), s.size(), needle.data(), needle.size()) || ContainsFolded(q.data(), q.size(), needle.data(), needle.size());
+        }
+    }));
+    Report(table, "match-tolower", n, Measure(n, [&] {
+        const std::wstring part = ToLower(needle); // once per pass: only the per-row copies are measured
+        for (const Proc& p : v) {
+            hits += ToLower(std::wstring(g_strings.Text(p.name))).find(part) != std::wstring::npos ||
+                ToLower(std::wstring(g_strings.Text(p.path))).find(part) != std::wstring::npos;
+        }
+    }));
+
+    std::vector<BYTE> out;
+    auto write = [&](auto fn) {
+        return [&, fn] {
+            out.clear();
+            Utf8Writer w(out);
+            fn(w);
+        };
+    };
+    Report(table, "json", n, Measure(n, write([&](Utf8Writer& w) { WriteJson(w, v); })));
+    Report(table, "csv", n, Measure(n, write([&](Utf8Writer& w) { WriteCsv(w, v); })));
+    Report(table, "pms", n, Measure(n, write([&](Utf8Writer& w) { WriteSnapshot(w, v); })));
+    RunHistory(table, a, b, cores);
+    if (!hits) printf("(no filter hits)\n"); // keeps the match loops from being optimized away
+}
+
+int wmain(int argc, wchar_t** argv) {
+    std::vector<size_t> sizes;
+    bool live = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::wstring a = argv[i];
+        const wchar_t* next = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (a == L"--rows" && next && wcstoul(next, nullptr, 10) > 0) sizes.push_back(wcstoul(argv[++i], nullptr, 10));
+        else if (a == L"--min-ms" && next && wcstod(next, nullptr) > 0) g_minMs = wcstod(argv[++i], nullptr);
+        else if (a == L"--live") live = true;
+        else { fprintf(stderr, "usage: ProcMonBench [--rows <n>]... [--live] [--min-ms <ms>]\n"); return a == L"--help" ? 0 : 2; }
+    }
+    if (sizes.empty()) sizes = { 1000, 10000, 100000 };
+
+    g_stats.on = true;
+    printf("%-8s %-14s %8s %12s %12s %8s\n", "table", "stage", "rows", "ns/row", "allocs/row", "runs");
+    for (size_t n : sizes) {
+        std::vector<Proc> v = SyntheticTable(n, 1);
+        char table[16];
+        snprintf(table, sizeof(table), "%uk", (unsigned)(n / 1000));
+        if (n % 1000) snprintf(table, sizeof(table), "%u", (unsigned)n);
+        RunStages(table, v);
+    }
+    if (live) {
+        LoadNtFunctions();
+        std::vector<Proc> v;
+        Snapshot(v, CollectPaths);
+        size_t n = v.size();
+        Report("live", "snapshot", n, Measure(n, [&] { Snapshot(v, CollectPaths); n = v.size(); }));
+        RunStages("live", v);
+    }
+    return 0;
+}
@@ -0,0 +1,1290 @@
+// ProcMonEngine - see ProcMonEngine.h. Author / Maintainer: Bob Paydar
+
+#include "ProcMonEngine.h"
+
+#include <psapi.h>
+#include <tlhelp32.h>
+#include <winternl.h>
+#include <processthreadsapi.h>
+#include <evntrace.h>
+#include <evntcons.h>
+#include <tdh.h>
+#include <sddl.h>
+#include <aclapi.h>
+
+#include <sstream>
+#include <iomanip>
+#include <climits>
+#include <thread>
+
+// SSE2 is baseline on every x86/x64 target; the filter kernel needs 16-bit wchar_t lanes.
+#if (defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)) && WCHAR_MAX == 0xFFFF
+#include <emmintrin.h>
+#define PROCMON_SSE2 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#pragma comment(lib, "psapi.lib")
+#pragma comment(lib, "tdh.lib")
+#pragma comment(lib, "advapi32.lib") // ETW sessions (StartTrace, ProcessTrace, ...)
+
+#ifndef STATUS_INFO_LENGTH_MISMATCH
+#define STATUS_INFO_LENGTH_MISMATCH ((LONG)0xC0000004L)
+#endif
+
+// -------------------- Small helpers --------------------
+void FoldInPlace(std::wstring& s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](wchar_t c) { return (wchar_t)towlower(c); });
+}
+std::wstring ToLower(std::wstring s) {
+    FoldInPlace(s);
+    return s;
+}
+// Exact UTF-16 substring test. The filter's haystack and needle are both case-folded
+// up front (g_strings / the caller), so no per-character folding is needed here.
+static bool ContainsScalar(const wchar_t* h, size_t hn, const wchar_t* n, size_t nn) {
+    if (nn == 0) return true;
+    for (size_t i = 0; i + nn <= hn; ++i) {
+        if (h[i] == n[0] && wmemcmp(h + i, n, nn) == 0) return true;
+    }
+    return false;
+}
+#if PROCMON_SSE2
+static inline unsigned LowestSetBit(unsigned m) {
+#ifdef _MSC_VER
+    unsigned long i; _BitScanForward(&i, m); return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctz(m);
+#endif
+}
+#endif
+// SSE2: test 8 candidate start positions per step by comparing the needle's first
+// and last code units, then confirm the survivors with wmemcmp. Long agent paths
+// mostly fail both compares, so the inner check rarely runs. Scalar for the tail.
+bool ContainsFolded(const wchar_t* h, size_t hn, const wchar_t* n, size_t nn) {
+    if (nn == 0) return true;
+    if (nn > hn) return false;
+#if PROCMON_SSE2
+    const size_t last = nn - 1;
+    const __m128i vFirst = _mm_set1_epi16((short)n[0]);
+    const __m128i vLast = _mm_set1_epi16((short)n[last]);
+    size_t i = 0;
+    for (; i + last + 8 <= hn; i += 8) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)(h + i));
+        const __m128i b = _mm_loadu_si128((const __m128i*)(h + i + last));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(a, vFirst), _mm_cmpeq_epi16(b, vLast)));
+        while (mask) {
+            const unsigned lane = LowestSetBit(mask) / 2; // two mask bits per 16-bit lane
+            if (nn <= 2 || wmemcmp(h + i + lane + 1, n + 1, nn - 2) == 0) return true;
+            mask &= ~(3u << (lane * 2));
+        }
+    }
+    return ContainsScalar(h + i, hn - i, n, nn);
+#else
+    return ContainsScalar(h, hn, n, nn);
+#endif
+}
+bool ContainsFolded(const std::wstring& hay, const std::wstring& needle) {
+    return ContainsFolded(hay.data(), hay.size(), needle.data(), needle.size());
+}
+std::wstring LastErrorMessage(DWORD err) {
+    if (err == 0) return L"OK";
+    LPWSTR buf = nullptr;
+    DWORD len = FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        nullptr, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPWSTR)&buf, 0, nullptr);
+    std::wstring msg = (len && buf) ? std::wstring(buf, len) : L"(unknown)";
+    if (buf) LocalFree(buf);
+    while (!msg.empty() && (msg.back() == L'\r' || msg.back() == L'\n')) msg.pop_back();
+    return msg;
+}
+uint64_t NowFileTime() {
+    FILETIME ft{};
+    GetSystemTimeAsFileTime(&ft);
+    return ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+bool LocalSystemTime(uint64_t ft, SYSTEMTIME& st) {
+    FILETIME utc{ (DWORD)ft, (DWORD)(ft >> 32) }, local{};
+    return FileTimeToLocalFileTime(&utc, &local) && FileTimeToSystemTime(&local, &st);
+}
+std::wstring FormatFileTime(uint64_t ft) { // local time, to the minute
+    SYSTEMTIME st{};
+    if (!LocalSystemTime(ft, st)) return L"?";
+    wchar_t buf[32];
+    swprintf_s(buf, L"%04u-%02u-%02u %02u:%02u", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute);
+    return buf;
+}
+std::wstring HumanSize(SIZE_T b) {
+    const wchar_t* u[] = { L"B", L"KB", L"MB", L"GB", L"TB" };
+    double d = (double)b; int i = 0;
+    while (d >= 1024.0 && i < 4) { d /= 1024.0; ++i; }
+    std::wstringstream ss; ss << std::fixed << std::setprecision(i ? 1 : 0) << d << L" " << u[i];
+    return ss.str();
+}
+
+// -------------------- Instrumentation --------------------
+Stats g_stats;
+
+double TicksToMs(int64_t t) {
+    static const double perMs = [] { LARGE_INTEGER q; QueryPerformanceFrequency(&q); return (double)q.QuadPart / 1000.0; }();
+    return (double)t / perMs;
+}
+
+// -------------------- Nt Suspend/Resume/Query --------------------
+NtSuspendProcess_t pNtSuspendProcess = nullptr;
+NtResumeProcess_t  pNtResumeProcess = nullptr;
+NtQuerySystemInformation_t pNtQuerySystemInformation = nullptr;
+RtlNtStatusToDosError_t pRtlNtStatusToDosError = nullptr;
+void LoadNtFunctions() {
+    HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+    if (!ntdll) return;
+    pNtSuspendProcess = (NtSuspendProcess_t)GetProcAddress(ntdll, "NtSuspendProcess");
+    pNtResumeProcess = (NtResumeProcess_t)GetProcAddress(ntdll, "NtResumeProcess");
+    pNtQuerySystemInformation = (NtQuerySystemInformation_t)GetProcAddress(ntdll, "NtQuerySystemInformation");
+    pRtlNtStatusToDosError = (RtlNtStatusToDosError_t)GetProcAddress(ntdll, "RtlNtStatusToDosError");
+}
+DWORD NtError(LONG st) { return st >= 0 ? 0 : pRtlNtStatusToDosError ? pRtlNtStatusToDosError(st) : ERROR_GEN_FAILURE; }
+
+// -------------------- String pool --------------------
+StringPool g_strings;
+
+// -------------------- Process model --------------------
+void DiffSnapshots(SampleByKey& prev, SampleByKey& scratch, std::vector<Proc>& next, SnapshotDiff& d, double secs, double cores) {
+    d.added.clear(); d.changed.clear(); d.removed.clear(); d.superseded = false;
+    const bool first = prev.empty();
+    const double perSec = secs > 0 ? 1.0 / secs : 0.0, cpuScale = perSec * 100.0 / (1e7 * cores);
+    scratch.clear();
+    for (size_t i = 0; i < next.size(); ++i) {
+        Proc& p = next[i];
+        auto it = prev.find(KeyOf(p));
+        // A process started since `prev` did all of its counting within the interval.
+        Sample before{};
+        if (it == prev.end()) { p.fresh = !first; d.added.push_back(i); }
+        else before = it->second;
+        auto delta = [](ULONGLONG now, ULONGLONG then) { return now >= then ? now - then : 0; };
+        const ULONGLONG cpu = delta(p.cpuTime, before.cpuTime), faults = delta(p.pageFaults, before.pageFaults);
+        const ULONGLONG rd = delta(p.readBytes, before.readBytes), wr = delta(p.writeBytes, before.writeBytes);
+        p.cpu = (float)std::min(100.0, (double)cpu * cpuScale);
+        p.faultRate = (float)(faults * perSec);
+        p.readRate = (float)(rd * perSec);
+        p.writeRate = (float)(wr * perSec);
+        if (it != prev.end()) {
+            const Sample& s = it->second;
+            const bool shownRate = s.cpu != 0 || s.faultRate != 0 || s.readRate != 0 || s.writeRate != 0; // would stay on screen unless repainted at 0
+            if (s.rss != p.rss || s.privateBytes != p.privateBytes || s.commit != p.commit || cpu || faults || rd || wr || s.path != p.path || shownRate)
+                d.changed.push_back(i);
+            prev.erase(it);
+        }
+        scratch.emplace(KeyOf(p), Sample{ p.rss, p.privateBytes, p.commit, p.cpuTime, p.pageFaults, p.readBytes, p.writeBytes, p.path,
+            p.cpu, p.faultRate, p.readRate, p.writeRate });
+    }
+    for (auto& kv : prev) d.removed.push_back(kv.first);
+    prev.swap(scratch);
+}
+
+// Image paths never change during a process's lifetime, so each one is resolved
+// once. Failures are cached too, so protected processes don't cost an OpenProcess
+// per refresh. Entries not seen by the latest snapshot are evicted. Worker thread only.
+struct PathCache {
+    struct Entry { uint32_t path; unsigned gen; };
+    std::unordered_map<ProcKey, Entry, ProcKeyHash> map;
+    unsigned gen = 0;
+};
+static PathCache g_paths;
+
+// ToolHelp fallback only: it needs a handle for every row on every refresh (memory
+// counters, CPU and creation time), so each PROCESS_QUERY_LIMITED_INFORMATION |
+// SYNCHRONIZE handle is held until its process exits instead of being reopened. A
+// held handle pins its PID, which therefore names one process (`created` pairs it
+// with a snapshot row). The Nt backend opens a process only for its path, once, so it
+// closes its handles right away. A thread-pool wait frees an entry as soon as the
+// process exits; `mu` keeps it from doing so while Snapshot() may be using the handle.
+struct CachedHandle {
+    HANDLE h;
+    ULONGLONG created; // 0 until known
+    PTP_WAIT wait;
+    DWORD pid;
+};
+struct HandleCache {
+    std::mutex mu; // Snapshot() holds it while it reads and uses the handles
+    std::unordered_map<DWORD, CachedHandle*> map;
+};
+static HandleCache g_handles;
+
+static void CALLBACK OnProcessExit(PTP_CALLBACK_INSTANCE, PVOID ctx, PTP_WAIT wait, TP_WAIT_RESULT) {
+    CachedHandle* e = (CachedHandle*)ctx;
+    {
+        std::lock_guard<std::mutex> lk(g_handles.mu);
+        g_handles.map.erase(e->pid);
+    }
+    CloseHandle(e->h);
+    CloseThreadpoolWait(wait); // allowed from its own callback
+    delete e;
+}
+// The cached handle for `p`, or null. A stale entry (the row's creation time differs)
+// belongs to an exited process whose wait hasn't fired yet. Caller holds g_handles.mu.
+static HANDLE CachedHandleFor(const Proc& p) {
+    auto it = g_handles.map.find(p.pid);
+    if (it == g_handles.map.end()) return nullptr;
+    if (p.created && it->second->created && p.created != it->second->created) return nullptr;
+    return it->second->h;
+}
+// Takes ownership of `h`: cached with an exit wait, or closed if the wait can't be armed
+// (or a stale entry still holds the PID). Caller holds g_handles.mu.
+static void CacheHandle(const Proc& p, HANDLE h) {
+    auto it = g_handles.map.find(p.pid);
+    CachedHandle* e = it == g_handles.map.end() ? new CachedHandle{ h, p.created, nullptr, p.pid } : nullptr;
+    if (e && (e->wait = CreateThreadpoolWait(OnProcessExit, e, nullptr))) {
+        SetThreadpoolWait(e->wait, h, nullptr);
+        g_handles.map.emplace(p.pid, e);
+        return;
+    }
+    delete e;
+    CloseHandle(h);
+}
+
+// SYSTEM_PROCESS_INFORMATION as returned by class 5; winternl.h only declares a
+// truncated version. Thread entries (NumberOfThreads of them) follow each record.
+struct SpiProcess {
+    ULONG NextEntryOffset;
+    ULONG NumberOfThreads;
+    LARGE_INTEGER WorkingSetPrivateSize;
+    ULONG HardFaultCount;
+    ULONG NumberOfThreadsHighWatermark;
+    ULONGLONG CycleTime;
+    LARGE_INTEGER CreateTime;
+    LARGE_INTEGER UserTime;
+    LARGE_INTEGER KernelTime;
+    UNICODE_STRING ImageName;
+    LONG BasePriority;
+    HANDLE UniqueProcessId;
+    HANDLE InheritedFromUniqueProcessId;
+    ULONG HandleCount;
+    ULONG SessionId;
+    ULONG_PTR UniqueProcessKey;
+    SIZE_T PeakVirtualSize;
+    SIZE_T VirtualSize;
+    ULONG PageFaultCount;
+    SIZE_T PeakWorkingSetSize;
+    SIZE_T WorkingSetSize;
+    SIZE_T QuotaPeakPagedPoolUsage;
+    SIZE_T QuotaPagedPoolUsage;
+    SIZE_T QuotaPeakNonPagedPoolUsage;
+    SIZE_T QuotaNonPagedPoolUsage;
+    SIZE_T PagefileUsage;
+    SIZE_T PeakPagefileUsage;
+    SIZE_T PrivatePageCount;
+    LARGE_INTEGER ReadOperationCount;
+    LARGE_INTEGER WriteOperationCount;
+    LARGE_INTEGER OtherOperationCount;
+    LARGE_INTEGER ReadTransferCount;
+    LARGE_INTEGER WriteTransferCount;
+    LARGE_INTEGER OtherTransferCount;
+};
+enum : ULONG { SystemProcessInformation_ = 5 };
+
+
+// Primary backend: every process in one kernel call, no per-process handles.
+// The buffer is kept across refreshes and grown on STATUS_INFO_LENGTH_MISMATCH.
+static bool SnapshotNt(std::vector<Proc>& v) {
+    if (!pNtQuerySystemInformation) return false;
+    static std::vector<BYTE> buf; // only touched by the snapshot worker
+    if (buf.empty()) buf.resize(512 * 1024);
+    LONG st = STATUS_INFO_LENGTH_MISMATCH;
+    for (int tries = 0; tries < 8 && st == STATUS_INFO_LENGTH_MISMATCH; ++tries) {
+        ULONG need = 0;
+        st = pNtQuerySystemInformation(SystemProcessInformation_, buf.data(), (ULONG)buf.size(), &need);
+        // Processes may start between calls; leave headroom so the retry usually sticks.
+        if (st == STATUS_INFO_LENGTH_MISMATCH) buf.resize(std::max<size_t>((size_t)need + need / 8, buf.size() * 2));
+    }
+    if (st < 0) return false;
+
+    for (size_t off = 0;;) {
+        const SpiProcess& e = *(const SpiProcess*)(buf.data() + off);
+        Proc p;
+        p.pid = (DWORD)(ULONG_PTR)e.UniqueProcessId;
+        p.ppid = (DWORD)(ULONG_PTR)e.InheritedFromUniqueProcessId;
+        if (e.ImageName.Buffer) p.name = g_strings.Intern(std::wstring_view(e.ImageName.Buffer, e.ImageName.Length / sizeof(WCHAR)));
+        else if (p.pid == 0) p.name = g_strings.Intern(L"[System Process]"); // same label ToolHelp uses
+        p.rss = e.WorkingSetSize;
+        p.cpuTime = (ULONGLONG)e.KernelTime.QuadPart + (ULONGLONG)e.UserTime.QuadPart;
+        p.privateBytes = e.PrivatePageCount; // bytes, despite the name
+        p.commit = e.PagefileUsage;
+        p.pageFaults = e.PageFaultCount;
+        p.readBytes = (ULONGLONG)e.ReadTransferCount.QuadPart;
+        p.writeBytes = (ULONGLONG)e.WriteTransferCount.QuadPart;
+        p.created = (ULONGLONG)e.CreateTime.QuadPart;
+        v.push_back(p);
+        if (!e.NextEntryOffset) break;
+        off += e.NextEntryOffset;
+    }
+    return true;
+}
+// Fallback backend: PID/PPID/name only; the rest comes from per-process handles.
+static bool SnapshotToolhelp(std::vector<Proc>& v) {
+    HANDLE snap = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (snap == INVALID_HANDLE_VALUE) return false;
+
+    PROCESSENTRY32W pe; pe.dwSize = sizeof(pe);
+    if (Process32FirstW(snap, &pe)) {
+        do {
+            Proc p; p.pid = pe.th32ProcessID; p.ppid = pe.th32ParentProcessID; p.name = g_strings.Intern(pe.szExeFile);
+            v.push_back(p);
+        } while (Process32NextW(snap, &pe));
+    }
+    CloseHandle(snap);
+    return true;
+}
+
+static uint32_t QueryImagePath(HANDLE h) {
+    wchar_t buf[MAX_PATH * 4] = { 0 }; DWORD sz = (DWORD)(MAX_PATH * 4);
+    return QueryFullProcessImageNameW(h, 0, buf, &sz) ? g_strings.Intern(std::wstring_view(buf, sz)) : 0;
+}
+// Per-process details that need a handle (`h`, limited query access). With the Nt
+// backend only the image path is missing; the ToolHelp fallback also needs memory
+// counters, CPU time, the creation time and (if `collect` asks) I/O counters.
+// Returns true if the path was queried, false if the fallback found it in g_paths.
+// Safe to run concurrently.
+static bool QueryDetails(Proc& p, HANDLE h, bool nt, unsigned collect) {
+    bool query = true;
+    if (!nt) {
+        PROCESS_MEMORY_COUNTERS_EX pmc{};
+        if (GetProcessMemoryInfo(h, (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc))) {
+            p.rss = pmc.WorkingSetSize;
+            p.privateBytes = pmc.PrivateUsage;
+            p.commit = pmc.PagefileUsage;
+            p.pageFaults = pmc.PageFaultCount;
+        }
+        IO_COUNTERS io{};
+        if ((collect & CollectIo) && GetProcessIoCounters(h, &io)) {
+            p.readBytes = io.ReadTransferCount;
+            p.writeBytes = io.WriteTransferCount;
+        }
+        FILETIME c{}, x{}, k{}, u{};
+        if (GetProcessTimes(h, &c, &x, &k, &u)) {
+            p.created = ((ULONGLONG)c.dwHighDateTime << 32) | c.dwLowDateTime;
+            p.cpuTime = (((ULONGLONG)k.dwHighDateTime << 32) | k.dwLowDateTime) + (((ULONGLONG)u.dwHighDateTime << 32) | u.dwLowDateTime);
+        }
+        query = !(p.created && g_paths.map.count(KeyOf(p)));
+    }
+    if (query) p.path = QueryImagePath(h);
+    return query;
+}
+
+// Lazy path loader (see RequestPaths): a pool work item drains `queue` until it is
+// empty; `learned` is folded into g_paths by the next Snapshot().
+struct PathLoader {
+    std::mutex mu;
+    std::vector<ProcKey> queue;      // requested, not resolved yet
+    std::vector<PathResult> done;    // resolved, not taken yet
+    std::vector<PathResult> learned; // resolved, not in g_paths yet
+    PTP_WORK work = nullptr;
+    bool running = false;            // `work` is submitted or draining
+    void (*notify)(void*) = nullptr;
+    void* ctx = nullptr;
+};
+static PathLoader g_lazy;
+
+// 0 if the process can't be opened or its PID now belongs to another process.
+static uint32_t ResolvePath(const ProcKey& k) {
+    HANDLE h = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, k.pid);
+    if (!h) {
+        if (GetLastError() == ERROR_ACCESS_DENIED) Count(CountDenied);
+        return 0;
+    }
+    Count(CountHandles);
+    FILETIME c{}, x{}, kt{}, ut{};
+    const bool same = !k.created || (GetProcessTimes(h, &c, &x, &kt, &ut) && (((ULONGLONG)c.dwHighDateTime << 32) | c.dwLowDateTime) == k.created);
+    const uint32_t path = same ? QueryImagePath(h) : 0;
+    CloseHandle(h);
+    return path;
+}
+static void CALLBACK DrainPathQueue(PTP_CALLBACK_INSTANCE, PVOID, PTP_WORK) {
+    std::vector<ProcKey> keys;
+    std::vector<PathResult> got;
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lk(g_lazy.mu);
+            keys.clear();
+            keys.swap(g_lazy.queue);
+            if (keys.empty()) { g_lazy.running = false; return; }
+        }
+        got.clear();
+        for (const ProcKey& k : keys) got.push_back(PathResult{ k, ResolvePath(k) });
+        void (*notify)(void*) = nullptr;
+        void* ctx = nullptr;
+        {
+            std::lock_guard<std::mutex> lk(g_lazy.mu);
+            if (g_lazy.done.empty()) { notify = g_lazy.notify; ctx = g_lazy.ctx; }
+            g_lazy.done.insert(g_lazy.done.end(), got.begin(), got.end());
+            g_lazy.learned.insert(g_lazy.learned.end(), got.begin(), got.end());
+        }
+        if (notify) notify(ctx);
+    }
+}
+void RequestPaths(const std::vector<ProcKey>& keys, void (*notify)(void*), void* ctx) {
+    if (keys.empty()) return;
+    std::lock_guard<std::mutex> lk(g_lazy.mu);
+    g_lazy.notify = notify;
+    g_lazy.ctx = ctx;
+    g_lazy.queue.insert(g_lazy.queue.end(), keys.begin(), keys.end());
+    if (g_lazy.running) return;
+    if (!g_lazy.work && !(g_lazy.work = CreateThreadpoolWork(DrainPathQueue, nullptr, nullptr))) return;
+    g_lazy.running = true;
+    SubmitThreadpoolWork(g_lazy.work);
+}
+void TakePaths(std::vector<PathResult>& out) {
+    out.clear();
+    std::lock_guard<std::mutex> lk(g_lazy.mu);
+    out.swap(g_lazy.done);
+}
+void StopPathLoader() {
+    PTP_WORK work;
+    {
+        std::lock_guard<std::mutex> lk(g_lazy.mu);
+        g_lazy.queue.clear();
+        g_lazy.notify = nullptr;
+        work = g_lazy.work;
+    }
+    if (work) WaitForThreadpoolWorkCallbacks(work, FALSE);
+}
+void LoadPaths(std::vector<Proc>& v) {
+    std::vector<uint32_t> lazy;
+    for (uint32_t i = 0; i < (uint32_t)v.size(); ++i) if (v[i].lazyPath) lazy.push_back(i);
+    if (lazy.empty()) return;
+    ParallelFor(lazy.size(), [&](size_t k) { Proc& p = v[lazy[k]]; p.path = ResolvePath(KeyOf(p)); p.lazyPath = false; });
+    std::lock_guard<std::mutex> lk(g_lazy.mu);
+    for (uint32_t i : lazy) g_lazy.learned.push_back(PathResult{ KeyOf(v[i]), v[i].path });
+}
+
+// Snapshot of processes (refills v; reusing the caller's vector keeps its capacity)
+void Snapshot(std::vector<Proc>& v, unsigned collect) {
+    v.clear();
+    const bool nt = SnapshotNt(v);
+    if (!nt) { v.clear(); if (!SnapshotToolhelp(v)) return; }
+
+    const unsigned gen = ++g_paths.gen;
+    {
+        std::lock_guard<std::mutex> lk(g_lazy.mu);
+        for (const PathResult& r : g_lazy.learned) g_paths.map[r.key] = PathCache::Entry{ r.path, gen };
+        g_lazy.learned.clear();
+    }
+    auto fromCache = [&](Proc& p) {
+        if (!p.created) return false;
+        auto it = g_paths.map.find(KeyOf(p));
+        if (it == g_paths.map.end()) return false;
+        it->second.gen = gen;
+        p.path = it->second.path;
+        return true;
+    };
+    // Pass 1 (this thread): rows that still need a handle, and (ToolHelp) their cached
+    // handles. With the Nt backend that is only processes whose path isn't cached yet,
+    // and only if the caller wants every path now.
+    std::lock_guard<std::mutex> lk(g_handles.mu); // exit waits must not close `held` before pass 3
+    std::vector<uint32_t> todo;
+    std::vector<HANDLE> held;
+    for (uint32_t i = 0; i < (uint32_t)v.size(); ++i) {
+        if (v[i].pid == 0) continue; // Idle
+        if (nt && fromCache(v[i])) continue;
+        if (nt && !(collect & CollectPaths)) { v[i].lazyPath = true; continue; }
+        todo.push_back(i);
+        held.push_back(nt ? nullptr : CachedHandleFor(v[i]));
+    }
+    // Pass 2 (thread pool): each task writes only its own row and slot; g_paths and
+    // g_handles are read-only here.
+    std::vector<char> queried(todo.size());
+    std::vector<HANDLE> opened(todo.size(), nullptr);
+    ParallelFor(todo.size(), [&](size_t k) {
+        HANDLE h = held[k];
+        if (!h) {
+            h = opened[k] = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | (nt ? 0 : SYNCHRONIZE), FALSE, v[todo[k]].pid);
+            if (!h) {
+                if (GetLastError() == ERROR_ACCESS_DENIED) Count(CountDenied);
+                queried[k] = 1;
+                return;
+            }
+            Count(CountHandles);
+        }
+        queried[k] = QueryDetails(v[todo[k]], h, nt, collect);
+    });
+    // Pass 3 (this thread): fold the results into the caches.
+    for (size_t k = 0; k < todo.size(); ++k) {
+        Proc& p = v[todo[k]];
+        if (opened[k] && nt) CloseHandle(opened[k]);
+        else if (opened[k]) CacheHandle(p, opened[k]);
+        if (!queried[k]) fromCache(p);
+        else if (p.created) g_paths.map[KeyOf(p)] = PathCache::Entry{ p.path, gen };
+    }
+    for (auto it = g_paths.map.begin(); it != g_paths.map.end();) {
+        if (it->second.gen != gen) it = g_paths.map.erase(it);
+        else ++it;
+    }
+}
+static bool IsParentOf(const Proc& parent, const Proc& child) {
+    if (parent.pid == child.pid) return false;
+    return !parent.created || !child.created || parent.created < child.created; // 0 = unknown
+}
+void BuildProcTree(const std::vector<Proc>& v, const std::vector<uint32_t>& order, ProcTree& t) {
+    const size_t n = v.size();
+    t.rowOf.clear(); t.rowOf.reserve(n);
+    for (uint32_t i = 0; i < (uint32_t)n; ++i) t.rowOf.emplace(v[i].pid, i);
+    t.parent.assign(n, -1);
+    for (uint32_t i = 0; i < (uint32_t)n; ++i) {
+        auto it = t.rowOf.find(v[i].ppid);
+        if (it != t.rowOf.end() && IsParentOf(v[it->second], v[i])) t.parent[i] = (int32_t)it->second;
+    }
+    // Unknown creation times can still close a loop; cut each one where a walk re-enters itself.
+    std::vector<char> state(n, 0); // 0 unseen, 1 on the current walk, 2 done
+    std::vector<uint32_t> walk;
+    for (uint32_t i = 0; i < (uint32_t)n; ++i) {
+        walk.clear();
+        for (uint32_t r = i;; r = (uint32_t)t.parent[r]) {
+            if (state[r] == 1) { t.parent[r] = -1; break; }
+            if (state[r] == 2) break;
+            state[r] = 1; walk.push_back(r);
+            if (t.parent[r] < 0) break;
+        }
+        for (uint32_t r : walk) state[r] = 2;
+    }
+    t.childAt.assign(n + 1, 0);
+    for (uint32_t i = 0; i < (uint32_t)n; ++i) if (t.parent[i] >= 0) ++t.childAt[(size_t)t.parent[i] + 1];
+    for (size_t i = 0; i < n; ++i) t.childAt[i + 1] += t.childAt[i];
+    t.children.resize(t.childAt[n]);
+    std::vector<uint32_t> fill(t.childAt.begin(), t.childAt.end() - 1);
+    t.roots.clear();
+    for (uint32_t r : order) {
+        if (t.parent[r] < 0) t.roots.push_back(r);
+        else t.children[fill[(size_t)t.parent[r]]++] = r;
+    }
+    t.preorder.clear(); t.preorder.reserve(n);
+    std::vector<uint32_t> stack(t.roots.rbegin(), t.roots.rend());
+    while (!stack.empty()) {
+        const uint32_t r = stack.back(); stack.pop_back();
+        t.preorder.push_back(r);
+        for (uint32_t k = t.childAt[r + 1]; k > t.childAt[r]; --k) stack.push_back(t.children[k - 1]);
+    }
+    t.depth.resize(n);
+    for (uint32_t r : t.preorder) t.depth[r] = t.parent[r] < 0 ? 0 : t.depth[(size_t)t.parent[r]] + 1;
+    t.subRss.resize(n); t.subCpu.resize(n); t.subCount.resize(n);
+    for (size_t i = 0; i < n; ++i) { t.subRss[i] = v[i].rss; t.subCpu[i] = v[i].cpu; t.subCount[i] = 1; }
+    for (size_t k = t.preorder.size(); k-- > 0;) {
+        const uint32_t r = t.preorder[k];
+        const int32_t p = t.parent[r];
+        if (p < 0) continue;
+        t.subRss[(size_t)p] += t.subRss[r]; t.subCpu[(size_t)p] += t.subCpu[r]; t.subCount[(size_t)p] += t.subCount[r];
+    }
+}
+bool CollectTree(DWORD pid, const ProcTree& t, std::vector<char>& seen, std::vector<uint32_t>& rows) {
+    auto it = t.rowOf.find(pid);
+    if (it == t.rowOf.end()) return false;
+    seen.resize(t.parent.size());
+    std::vector<uint32_t> stack{ it->second };
+    while (!stack.empty()) {
+        const uint32_t r = stack.back(); stack.pop_back();
+        if (seen[r]) continue;
+        seen[r] = 1;
+        rows.push_back(r);
+        for (uint32_t k = t.childAt[r + 1]; k > t.childAt[r]; --k) stack.push_back(t.children[k - 1]);
+    }
+    return true;
+}
+
+// -------------------- Batched actions --------------------
+std::wstring ActionOutcome(DWORD e) {
+    switch (e) {
+    case 0: return L"done";
+    case ERROR_NOT_FOUND: return L"already exited";
+    case ERROR_ACCESS_DENIED: return L"access denied";
+    case WAIT_TIMEOUT: return L"still running";
+    default: return L"error " + std::to_wstring(e);
+    }
+}
+
+// -------------------- Binary snapshot --------------------
+// Section `id` if it lies inside the file, is aligned and (unless kAnySize) is `bytes` long.
+static const uint64_t kAnySize = ~0ull;
+static const BYTE* PmsFind(const SnapshotArchive& a, uint32_t id, uint64_t bytes, uint64_t* size = nullptr) {
+    const PmsSection* dir = (const PmsSection*)(a.base + a.hdr->headerSize);
+    for (uint32_t k = 0; k < a.hdr->sections; ++k) {
+        const PmsSection& s = dir[k];
+        if (s.id != id) continue;
+        if (s.offset % 8 || s.offset > a.size || s.size > a.size - s.offset) return nullptr;
+        if (bytes != kAnySize && s.size != bytes) return nullptr;
+        if (size) *size = s.size;
+        return a.base + s.offset;
+    }
+    return nullptr;
+}
+bool MapArchive(const std::wstring& file, SnapshotArchive& a) {
+    HANDLE h = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    DWORD err = ERROR_BAD_FORMAT;
+    LARGE_INTEGER size{};
+    if (!GetFileSizeEx(h, &size)) err = GetLastError();
+    else if (size.QuadPart >= (LONGLONG)sizeof(PmsHeader)) {
+        if (HANDLE m = CreateFileMappingW(h, nullptr, PAGE_READONLY, 0, 0, nullptr)) {
+            a.base = (const BYTE*)MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+            if (!a.base) err = GetLastError();
+            CloseHandle(m); // the view keeps the section alive
+        }
+        else err = GetLastError();
+    }
+    CloseHandle(h);
+    if (!a.base) { SetLastError(err); return false; }
+
+    a.size = (uint64_t)size.QuadPart;
+    a.hdr = (const PmsHeader*)a.base;
+    const PmsHeader& hd = *a.hdr;
+    bool ok = hd.magic == kPmsMagic && hd.version == kPmsVersion && hd.headerSize >= sizeof(PmsHeader) &&
+        hd.headerSize % 8 == 0 && hd.headerSize <= a.size && (a.size - hd.headerSize) / sizeof(PmsSection) >= hd.sections;
+    if (ok) {
+        const uint64_t n = hd.rows;
+        uint64_t dataBytes = 0;
+        a.pid = (const uint32_t*)PmsFind(a, PmsPid, n * 4);
+        a.ppid = (const uint32_t*)PmsFind(a, PmsPpid, n * 4);
+        a.rss = (const uint64_t*)PmsFind(a, PmsRss, n * 8);
+        a.created = (const uint64_t*)PmsFind(a, PmsCreated, n * 8);
+        a.cpuTime = (const uint64_t*)PmsFind(a, PmsCpuTime, n * 8);
+        a.privateBytes = (const uint64_t*)PmsFind(a, PmsPrivate, n * 8);
+        a.commit = (const uint64_t*)PmsFind(a, PmsCommit, n * 8);
+        a.pageFaults = (const uint64_t*)PmsFind(a, PmsFaults, n * 8);
+        a.readBytes = (const uint64_t*)PmsFind(a, PmsRead, n * 8);
+        a.writeBytes = (const uint64_t*)PmsFind(a, PmsWrite, n * 8);
+        a.name = (const uint32_t*)PmsFind(a, PmsName, n * 4);
+        a.path = (const uint32_t*)PmsFind(a, PmsPath, n * 4);
+        a.strOff = (const uint32_t*)PmsFind(a, PmsStrOff, ((uint64_t)hd.strings + 1) * 4);
+        a.strData = (const wchar_t*)PmsFind(a, PmsStrData, kAnySize, &dataBytes);
+        a.strChars = dataBytes / sizeof(wchar_t);
+        ok = a.pid && a.ppid && a.rss && a.created && a.name && a.path && a.strOff && a.strData;
+        uint64_t histBytes = 0;
+        const BYTE* hist = PmsFind(a, PmsHistory, kAnySize, &histBytes);
+        if (hist && histBytes >= sizeof(PmsHistoryHeader)) a.historyFrames = ((const PmsHistoryHeader*)hist)->frames;
+    }
+    if (!ok) {
+        UnmapViewOfFile(a.base);
+        a = SnapshotArchive();
+        SetLastError(ERROR_BAD_FORMAT);
+        return false;
+    }
+    a.file = file;
+    return true;
+}
+
+// -------------------- History recording --------------------
+// While View > Record history is on, every snapshot the worker takes is appended
+// to a log as one frame, built from its SnapshotDiff, so a frame only costs the
+// processes that started, exited or changed. The log starts from a keyframe (the
+// rows when recording began).
+//
+//   frame := varint(ms since previous frame) varint(entries) entry*
+//   entry := varint(pidDelta << 2 | kind) payload   (sorted by PID; pidDelta from the
+//            previous entry, the first from 0; an exit sorts before a reused PID's start)
+//     kind 0  exited
+//     kind 1  started: varint(ppid) varint(created) varint(nameId) varint(pathId) then
+//             varint(counter) for each of the counters, in bit order
+//     kind 2  changed: varint(field mask) then zigzag(delta) per set bit, lowest bit first
+// Counters (mask bits): 0 = RSS, 1 = CPU time (kernel + user), 2 = private bytes,
+// 3 = commit, 4 = page faults, 5 = I/O read bytes, 6 = I/O write bytes. Sizes are kept
+// in 4 KB pages, CPU time in milliseconds, I/O in KB. Files written before bits 2-6
+// existed say 0 counters in their HISTORY header and carry only bits 0 and 1. Varints
+// are LEB128, zigzag maps signed deltas to small unsigned ones.
+//
+// Budget: kHistoryBytes of frames. Estimated from the encoding: a changed entry is a
+// 1-2 byte tag, a mask byte, 1-2 bytes each for RSS, CPU, private, commit and faults,
+// and I/O deltas for the third or so of processes doing I/O, ~11.5 bytes; so 1k
+// processes with ~30% changing cost ~3.4 KB per frame, ~12 MB per hour at one frame a
+// second, and the default holds about 80 minutes of that. Worst case (all 1k changing
+// every counter by large amounts, ~23 bytes an entry) is ~80 MB per hour. ProcMonBench's
+// history stage measures the bytes per frame of its synthetic tables. When
+// the log is full it spills as a .pms file to %LOCALAPPDATA%\ProcMonUI\History and starts
+// over from a new keyframe; if that fails, the oldest quarter of the frames is
+// folded into the keyframe instead.
+static const size_t kHistoryBytes = 16u << 20;
+
+static const uint32_t kHistoryCounters = 7;
+struct HistRow { DWORD ppid; uint64_t created, c[kHistoryCounters]; uint32_t name, path; };
+using HistState = std::unordered_map<DWORD, HistRow>; // by PID; live PIDs are unique
+struct HistoryRecorder {
+    std::mutex mu;                  // worker appends, UI copies for File > Save history
+    bool recording = false, started = false;
+    HistoryLog log;
+    HistState base, cur;            // state at the keyframe / after the latest frame
+    std::vector<size_t> frameAt;    // offset of each frame in log.bytes
+    std::unordered_map<uint32_t, uint32_t> ids; // g_strings ID -> log.strings index
+    uint64_t last = 0;              // FILETIME of the latest frame
+};
+static HistoryRecorder g_history;
+
+static void PutVarint(std::vector<BYTE>& b, uint64_t v) {
+    while (v >= 0x80) { b.push_back((BYTE)(v | 0x80)); v >>= 7; }
+    b.push_back((BYTE)v);
+}
+static bool GetVarint(const BYTE*& p, const BYTE* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        const BYTE c = *p++;
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+static uint64_t ZigZag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static int64_t UnZigZag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+// `p`'s counters in history units, in mask-bit order (see above), and back.
+static void HistoryCounters(const Proc& p, uint64_t (&c)[kHistoryCounters]) {
+    c[0] = p.rss >> 12; c[1] = p.cpuTime / 10000; c[2] = p.privateBytes >> 12; c[3] = p.commit >> 12;
+    c[4] = p.pageFaults; c[5] = p.readBytes >> 10; c[6] = p.writeBytes >> 10;
+}
+static void HistoryRestore(const uint64_t (&c)[kHistoryCounters], Proc& p) {
+    p.rss = (SIZE_T)(c[0] << 12); p.cpuTime = c[1] * 10000; p.privateBytes = (SIZE_T)(c[2] << 12); p.commit = (SIZE_T)(c[3] << 12);
+    p.pageFaults = c[4]; p.readBytes = c[5] << 10; p.writeBytes = c[6] << 10;
+}
+static HistRow HistoryRowOf(const Proc& p) {
+    HistRow h{ p.ppid, p.created, {}, 0, 0 };
+    HistoryCounters(p, h.c);
+    return h;
+}
+static uint32_t HistoryIntern(uint32_t s) {
+    HistoryRecorder& r = g_history;
+    auto it = r.ids.emplace(s, (uint32_t)r.log.strings.size());
+    if (it.second) r.log.strings.emplace_back(g_strings.Text(s));
+    return it.first->second;
+}
+// Start a new log whose keyframe is `v`.
+static void HistoryRestart(const std::vector<Proc>& v, uint64_t now) {
+    HistoryRecorder& r = g_history;
+    r.log = HistoryLog();
+    r.log.start = r.last = now;
+    r.log.counters = kHistoryCounters;
+    r.ids.clear(); r.cur.clear(); r.frameAt.clear();
+    for (const Proc& p : v) {
+        HistRow h = HistoryRowOf(p);
+        h.name = HistoryIntern(p.name); h.path = HistoryIntern(p.path);
+        r.cur[p.pid] = h;
+    }
+    r.base = r.cur;
+    r.started = true;
+}
+// Apply one encoded frame to `s`; returns the next frame, or null if it is malformed.
+static const BYTE* HistoryApply(HistState& s, const BYTE* p, const BYTE* end, uint64_t& ms) {
+    uint64_t n = 0, tag = 0, pid = 0, x = 0;
+    if (!GetVarint(p, end, ms) || !GetVarint(p, end, n)) return nullptr;
+    for (; n; --n) {
+        if (!GetVarint(p, end, tag)) return nullptr;
+        pid += tag >> 2;
+        switch (tag & 3) {
+        case 0:
+            s.erase((DWORD)pid);
+            break;
+        case 1: {
+            uint64_t f[4];
+            HistRow h{};
+            for (auto& v : f) if (!GetVarint(p, end, v)) return nullptr;
+            for (auto& v : h.c) if (!GetVarint(p, end, v)) return nullptr;
+            h.ppid = (DWORD)f[0]; h.created = f[1]; h.name = (uint32_t)f[2]; h.path = (uint32_t)f[3];
+            s[(DWORD)pid] = h;
+            break;
+        }
+        case 2: {
+            uint64_t mask = 0;
+            if (!GetVarint(p, end, mask)) return nullptr;
+            HistRow& h = s[(DWORD)pid];
+            if (mask >> kHistoryCounters) return nullptr;
+            for (uint32_t bit = 0; bit < kHistoryCounters; ++bit) {
+                if (!((mask >> bit) & 1)) continue;
+                if (!GetVarint(p, end, x)) return nullptr;
+                h.c[bit] += (uint64_t)UnZigZag(x);
+            }
+            break;
+        }
+        default:
+            return nullptr;
+        }
+    }
+    return p;
+}
+// Keyframe rows for writing the log out (sorted by PID, counters back in their units).
+static std::vector<Proc> HistoryKeyframe() {
+    const HistoryRecorder& r = g_history;
+    std::vector<Proc> rows; rows.reserve(r.base.size());
+    for (const auto& kv : r.base) {
+        Proc p;
+        p.pid = kv.first; p.ppid = kv.second.ppid; p.created = kv.second.created;
+        HistoryRestore(kv.second.c, p);
+        p.name = g_strings.Intern(r.log.strings[kv.second.name]); p.path = g_strings.Intern(r.log.strings[kv.second.path]);
+        rows.push_back(p);
+    }
+    std::sort(rows.begin(), rows.end(), [](const Proc& a, const Proc& b) { return a.pid < b.pid; });
+    return rows;
+}
+// Fold the oldest quarter of the frames into the keyframe.
+static void HistoryDropOldest() {
+    HistoryRecorder& r = g_history;
+    const size_t drop = std::max<size_t>(r.frameAt.size() / 4, 1);
+    const BYTE* p = r.log.bytes.data();
+    const BYTE* end = p + r.log.bytes.size();
+    for (size_t k = 0; k < drop; ++k) {
+        uint64_t ms = 0;
+        p = HistoryApply(r.base, p, end, ms);
+        if (!p) { r.started = false; return; } // can't happen for frames we wrote; start over
+        r.log.start += ms * 10000;
+    }
+    const size_t cut = (size_t)(p - r.log.bytes.data());
+    r.log.bytes.erase(r.log.bytes.begin(), r.log.bytes.begin() + cut);
+    r.frameAt.erase(r.frameAt.begin(), r.frameAt.begin() + drop);
+    for (size_t& at : r.frameAt) at -= cut;
+    r.log.frames -= (uint32_t)drop;
+}
+static bool HistorySpillPath(std::wstring& path) {
+    wchar_t base[MAX_PATH] = L"";
+    const DWORD n = GetEnvironmentVariableW(L"LOCALAPPDATA", base, MAX_PATH);
+    if (!n || n >= MAX_PATH) return false;
+    path = std::wstring(base) + L"\\ProcMonUI";
+    CreateDirectoryW(path.c_str(), nullptr);
+    path += L"\\History";
+    if (!CreateDirectoryW(path.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) return false;
+    SYSTEMTIME st{};
+    if (!LocalSystemTime(g_history.log.start, st)) return false;
+    wchar_t name[64];
+    swprintf_s(name, L"\\history-%04u%02u%02u-%02u%02u%02u.pms", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+    path += name;
+    return true;
+}
+void RecordHistory(const std::vector<Proc>& v, const SnapshotDiff& d) {
+    std::lock_guard<std::mutex> lk(g_history.mu);
+    HistoryRecorder& r = g_history;
+    if (!r.recording) return;
+    const uint64_t now = NowFileTime();
+    if (!r.started) { HistoryRestart(v, now); return; }
+
+    struct Entry { DWORD pid; unsigned kind; size_t row; };
+    std::vector<Entry> e;
+    e.reserve(d.removed.size() + d.added.size() + d.changed.size());
+    for (const ProcKey& k : d.removed) e.push_back(Entry{ k.pid, 0, 0 });
+    for (size_t i : d.added) e.push_back(Entry{ v[i].pid, 1, i });
+    for (size_t i : d.changed) {
+        auto it = r.cur.find(v[i].pid);
+        uint64_t c[kHistoryCounters];
+        HistoryCounters(v[i], c);
+        if (it == r.cur.end() || !std::equal(c, c + kHistoryCounters, it->second.c))
+            e.push_back(Entry{ v[i].pid, 2, i });
+    }
+    std::sort(e.begin(), e.end(), [](const Entry& a, const Entry& b) { return a.pid != b.pid ? a.pid < b.pid : a.kind < b.kind; });
+
+    std::vector<BYTE>& b = r.log.bytes;
+    r.frameAt.push_back(b.size());
+    const uint64_t ms = (now - r.last) / 10000;
+    r.last += ms * 10000; // whole milliseconds, so decoded times don't drift
+    PutVarint(b, ms);
+    PutVarint(b, e.size());
+    DWORD prevPid = 0;
+    for (const Entry& x : e) {
+        PutVarint(b, ((uint64_t)(x.pid - prevPid) << 2) | x.kind);
+        prevPid = x.pid;
+        if (x.kind == 0) { r.cur.erase(x.pid); continue; }
+        const Proc& p = v[x.row];
+        if (x.kind == 1) {
+            HistRow h = HistoryRowOf(p);
+            h.name = HistoryIntern(p.name); h.path = HistoryIntern(p.path);
+            PutVarint(b, h.ppid); PutVarint(b, h.created); PutVarint(b, h.name); PutVarint(b, h.path);
+            for (uint64_t c : h.c) PutVarint(b, c);
+            r.cur[x.pid] = h;
+        }
+        else {
+            HistRow& h = r.cur[x.pid];
+            uint64_t c[kHistoryCounters];
+            HistoryCounters(p, c);
+            unsigned mask = 0;
+            for (uint32_t bit = 0; bit < kHistoryCounters; ++bit) if (c[bit] != h.c[bit]) mask |= 1u << bit;
+            PutVarint(b, mask);
+            for (uint32_t bit = 0; bit < kHistoryCounters; ++bit)
+                if (mask & (1u << bit)) { PutVarint(b, ZigZag((int64_t)(c[bit] - h.c[bit]))); h.c[bit] = c[bit]; }
+        }
+    }
+    ++r.log.frames;
+    if (b.size() < kHistoryBytes) return;
+
+    std::wstring path;
+    const std::vector<Proc> keyframe = HistoryKeyframe();
+    if (HistorySpillPath(path) && SaveFile(path, [&](Utf8Writer& w) { return WriteSnapshot(w, keyframe, NoProgress(), &r.log); }))
+        HistoryRestart(v, now);
+    else
+        HistoryDropOldest();
+}
+void SetRecording(bool on) {
+    std::lock_guard<std::mutex> lk(g_history.mu);
+    g_history.recording = on;
+    if (on) g_history.started = false; // keyframe = next snapshot; the old log stays saveable until then
+}
+bool CopyHistory(std::vector<Proc>& keyframe, HistoryLog& log) {
+    std::lock_guard<std::mutex> lk(g_history.mu);
+    if (!g_history.started) return false;
+    keyframe = HistoryKeyframe();
+    log = g_history.log;
+    return true;
+}
+
+// -------------------- Shared snapshot --------------------
+// See ProcMonEngine.h for the protocol.
+struct SharedSnapshot {
+    HANDLE writer{};         // kShmWriterMutex, owned while open
+    HANDLE section{};
+    ShmHeader* hdr{};
+    bool live{};             // the header is ours and valid: publish, withdraw on close
+    std::vector<BYTE> image; // serialization buffer, reused
+};
+static SharedSnapshot g_shared; // opened/closed on the UI thread, written by the worker
+static std::mutex g_sharedMu;   // a publish in progress against CloseSharedSnapshot
+
+// The section and the writer mutex are created with an explicit DACL: full access for
+// this user only, SECTION_MAP_READ for everyone else. An existing section is only taken
+// over if it carries exactly that owner and DACL, so a squatter's can't be adopted.
+static bool CurrentUserSid(std::vector<BYTE>& sid) {
+    HANDLE token = nullptr;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) return false;
+    DWORD size = 0;
+    GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+    std::vector<BYTE> buf(size ? size : 1);
+    const bool ok = size && GetTokenInformation(token, TokenUser, buf.data(), size, &size);
+    CloseHandle(token);
+    if (!ok) return false;
+    PSID user = ((const TOKEN_USER*)buf.data())->User.Sid;
+    sid.assign((const BYTE*)user, (const BYTE*)user + GetLengthSid(user));
+    return true;
+}
+// `sd` from SDDL, "O:<user>D:P(A;;<mask>;;;<user>)" plus `others` ACEs; LocalFree it.
+static PSECURITY_DESCRIPTOR OwnerOnlyDescriptor(PSID user, DWORD mask, const wchar_t* others) {
+    wchar_t* text = nullptr;
+    if (!ConvertSidToStringSidW(user, &text)) return nullptr;
+    wchar_t sddl[256];
+    swprintf_s(sddl, L"O:%sD:P(A;;0x%lx;;;%s)%s", text, (unsigned long)mask, text, others);
+    LocalFree(text);
+    PSECURITY_DESCRIPTOR sd = nullptr;
+    return ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl, SDDL_REVISION_1, &sd, nullptr) ? sd : nullptr;
+}
+// True if section `s` is owned by `user` and its DACL is exactly the one we create.
+static bool SectionIsOurs(HANDLE s, PSID user) {
+    BYTE world[SECURITY_MAX_SID_SIZE];
+    DWORD worldSize = sizeof(world);
+    if (!CreateWellKnownSid(WinWorldSid, nullptr, world, &worldSize)) return false;
+    PSID owner = nullptr;
+    PACL dacl = nullptr;
+    PSECURITY_DESCRIPTOR sd = nullptr;
+    if (GetSecurityInfo(s, SE_KERNEL_OBJECT, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION, &owner, nullptr, &dacl, nullptr, &sd) != ERROR_SUCCESS)
+        return false;
+    bool ok = owner && EqualSid(owner, user) && dacl && dacl->AceCount == 2;
+    for (DWORD i = 0; ok && i < 2; ++i) {
+        void* p = nullptr;
+        ok = GetAce(dacl, i, &p) && ((ACE_HEADER*)p)->AceType == ACCESS_ALLOWED_ACE_TYPE;
+        if (!ok) break;
+        const ACCESS_ALLOWED_ACE* ace = (const ACCESS_ALLOWED_ACE*)p;
+        PSID sid = (PSID)&ace->SidStart;
+        ok = i == 0 ? ace->Mask == SECTION_ALL_ACCESS && EqualSid(sid, user) : ace->Mask == SECTION_MAP_READ && EqualSid(sid, world);
+    }
+    LocalFree(sd);
+    return ok;
+}
+
+// Published under the lock: a stale worker publish sees either nothing or the whole header.
+static void SetSharedLive() {
+    std::lock_guard<std::mutex> lk(g_sharedMu);
+    g_shared.live = true;
+}
+// Undo a partial OpenSharedSnapshot, keeping `err` as the last error.
+static bool FailShared(DWORD err) {
+    CloseSharedSnapshot();
+    SetLastError(err);
+    return false;
+}
+bool OpenSharedSnapshot() {
+    if (g_shared.hdr) return true;
+    std::vector<BYTE> user;
+    if (!CurrentUserSid(user)) return false;
+    PSECURITY_DESCRIPTOR mutexSd = OwnerOnlyDescriptor(user.data(), MUTEX_ALL_ACCESS, L"");
+    PSECURITY_DESCRIPTOR sectionSd = OwnerOnlyDescriptor(user.data(), SECTION_ALL_ACCESS, L"(A;;0x4;;;WD)"); // 0x4 = SECTION_MAP_READ
+    if (!mutexSd || !sectionSd) { const DWORD err = GetLastError(); LocalFree(mutexSd); LocalFree(sectionSd); SetLastError(err); return false; }
+    SECURITY_ATTRIBUTES mutexSa{ sizeof(mutexSa), mutexSd, FALSE }, sectionSa{ sizeof(sectionSa), sectionSd, FALSE };
+    // The mutex, not the section, says who writes: Windows frees it when its owner dies,
+    // while readers can hold the section open indefinitely.
+    HANDLE m = CreateMutexW(&mutexSa, FALSE, kShmWriterMutex);
+    const DWORD wait = m ? WaitForSingleObject(m, 0) : WAIT_FAILED;
+    if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED) {
+        const DWORD err = m ? ERROR_ALREADY_EXISTS : GetLastError();
+        if (m) CloseHandle(m);
+        LocalFree(mutexSd); LocalFree(sectionSd);
+        SetLastError(err);
+        return false;
+    }
+    g_shared.writer = m;
+    HANDLE s = CreateFileMappingW(INVALID_HANDLE_VALUE, &sectionSa, PAGE_READWRITE,
+        (DWORD)(kShmBytes >> 32), (DWORD)kShmBytes, kShmName);
+    const DWORD err = GetLastError();
+    LocalFree(mutexSd); LocalFree(sectionSd);
+    if (!s) return FailShared(err);
+    const bool existed = err == ERROR_ALREADY_EXISTS;
+    g_shared.section = s;
+    if (existed && !SectionIsOurs(s, user.data())) return FailShared(ERROR_ACCESS_DENIED); // not created by us: don't write into it
+    ShmHeader* h = (ShmHeader*)MapViewOfFile(s, FILE_MAP_WRITE, 0, 0, 0);
+    if (!h) return FailShared(GetLastError());
+    g_shared.hdr = h;
+    MEMORY_BASIC_INFORMATION mbi{};
+    if (existed && (!VirtualQuery(h, &mbi, sizeof(mbi)) || mbi.RegionSize < kShmBytes)) return FailShared(ERROR_ALREADY_EXISTS);
+    if (existed && h->magic == kShmMagic && h->version == kShmVersion && h->capacity == kShmBytes - sizeof(ShmHeader)) {
+        // Left by a writer that is gone. One that died mid-update left `seq` odd and
+        // the image torn: withdraw it (size 0) before readers see an even `seq` again.
+        if (h->seq & 1) { h->size = 0; InterlockedIncrement64(&h->seq); }
+        h->writerPid = GetCurrentProcessId();
+        SetSharedLive();
+        return true;
+    }
+    if (existed && h->magic) return FailShared(ERROR_ALREADY_EXISTS); // some other layout
+    h->version = kShmVersion;
+    h->capacity = kShmBytes - sizeof(ShmHeader);
+    h->writerPid = GetCurrentProcessId();
+    InterlockedExchange((volatile LONG*)&h->magic, (LONG)kShmMagic); // last: the header is valid
+    SetSharedLive();
+    return true;
+}
+void CloseSharedSnapshot() {
+    std::lock_guard<std::mutex> lk(g_sharedMu); // waits out the worker's current publish
+    if (ShmHeader* h = g_shared.hdr; h && g_shared.live) {
+        // Withdraw the image so readers see that publishing stopped, not a stale table.
+        InterlockedIncrement64(&h->seq);
+        h->size = 0;
+        h->timestamp = NowFileTime();
+        InterlockedIncrement64(&h->seq);
+    }
+    if (g_shared.hdr) UnmapViewOfFile(g_shared.hdr);
+    if (g_shared.section) CloseHandle(g_shared.section);
+    if (g_shared.writer) { ReleaseMutex(g_shared.writer); CloseHandle(g_shared.writer); }
+    g_shared = SharedSnapshot();
+}
+void PublishSnapshot(const std::vector<Proc>& v) {
+    std::lock_guard<std::mutex> lk(g_sharedMu);
+    if (!g_shared.live) return;
+    ShmHeader* h = g_shared.hdr;
+    std::vector<BYTE>& img = g_shared.image;
+    img.clear();
+    {
+        Utf8Writer w(img);
+        WriteSnapshot(w, v);
+    }
+    if (img.size() > h->capacity) { ++h->skipped; return; }
+    InterlockedIncrement64(&h->seq); // odd: readers retry
+    memcpy((BYTE*)h + sizeof(ShmHeader), img.data(), img.size());
+    h->size = img.size();
+    h->timestamp = NowFileTime();
+    ++h->published;
+    InterlockedIncrement64(&h->seq); // even: consistent again
+}
+
+// -------------------- Process events --------------------
+static const GUID kKernelProcessProvider = { 0x22fb2cd6, 0x0e7b, 0x422b, { 0xa0, 0xc7, 0x2f, 0xad, 0x1f, 0xd0, 0xe7, 0x16 } };
+// Sessions are per instance, "ProcMonUI.ProcessEvents.<pid>", so instances never stop
+// each other's; one left behind by a crash is stopped once its PID is gone.
+static const wchar_t kEventSessionPrefix[] = L"ProcMonUI.ProcessEvents.";
+static const size_t kMaxSessionName = 1024; // ETW's limit, in characters
+static const ULONG kMaxSessions = 64;       // system-wide
+static const ULONGLONG kKeywordProcess = 0x10; // WINEVENT_KEYWORD_PROCESS
+enum : USHORT { EventProcessStart = 1, EventProcessStop = 2 };
+static const size_t kMaxQueuedEvents = 1 << 16; // beyond this, starts/exits wait for the next snapshot
+
+struct EventSession {
+    TRACEHANDLE session = 0, trace = INVALID_PROCESSTRACE_HANDLE;
+    std::wstring name;         // kEventSessionPrefix + our PID
+    std::vector<BYTE> props;   // EVENT_TRACE_PROPERTIES + session name
+    std::thread thread;        // ProcessTrace, until the session stops
+    void (*notify)(void*) = nullptr;
+    void* ctx = nullptr;
+    std::vector<std::pair<std::wstring, std::wstring>> devices; // L"\\Device\\HarddiskVolume3" -> L"C:"
+    std::mutex mu;
+    std::vector<ProcEvent> queue; // guarded by mu
+};
+static EventSession g_events;
+
+static EVENT_TRACE_PROPERTIES* SessionProperties() {
+    const ULONG size = (ULONG)(sizeof(EVENT_TRACE_PROPERTIES) + kMaxSessionName * sizeof(wchar_t));
+    g_events.props.assign(size, 0);
+    EVENT_TRACE_PROPERTIES* p = (EVENT_TRACE_PROPERTIES*)g_events.props.data();
+    p->Wnode.BufferSize = size;
+    p->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
+    p->Wnode.ClientContext = 2; // system time stamps, i.e. FILETIMEs like the creation times
+    p->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
+    p->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+    return p;
+}
+// Image names in events are NT device paths; map the volume prefix to its drive letter.
+static void LoadDeviceMap() {
+    g_events.devices.clear();
+    const DWORD drives = GetLogicalDrives();
+    for (int d = 0; d < 26; ++d) {
+        if (!(drives & (1u << d))) continue;
+        const wchar_t drive[3] = { (wchar_t)(L'A' + d), L':', 0 };
+        wchar_t target[MAX_PATH];
+        if (QueryDosDeviceW(drive, target, MAX_PATH)) g_events.devices.emplace_back(target, drive);
+    }
+}
+static std::wstring DosPath(const std::wstring& nt) {
+    for (const auto& d : g_events.devices) {
+        const size_t n = d.first.size();
+        if (nt.size() > n && nt[n] == L'\\' && nt.compare(0, n, d.first) == 0) return d.second + nt.substr(n);
+    }
+    return nt;
+}
+template <class T>
+static bool EventProperty(PEVENT_RECORD e, const wchar_t* name, T& out) {
+    PROPERTY_DATA_DESCRIPTOR d{ (ULONGLONG)name, ULONG_MAX, 0 };
+    return TdhGetProperty(e, 0, nullptr, 1, &d, sizeof(T), (PBYTE)&out) == ERROR_SUCCESS;
+}
+static std::wstring EventString(PEVENT_RECORD e, const wchar_t* name) {
+    PROPERTY_DATA_DESCRIPTOR d{ (ULONGLONG)name, ULONG_MAX, 0 };
+    ULONG size = 0;
+    if (TdhGetPropertySize(e, 0, nullptr, 1, &d, &size) != ERROR_SUCCESS || size < sizeof(wchar_t)) return std::wstring();
+    std::wstring s(size / sizeof(wchar_t), L'\0');
+    if (TdhGetProperty(e, 0, nullptr, 1, &d, size, (PBYTE)&s[0]) != ERROR_SUCCESS) return std::wstring();
+    s.resize(wcsnlen(s.c_str(), s.size()));
+    return s;
+}
+// Session thread. Fields are read by name through TDH, so newer event versions with
+// extra fields still parse.
+static void WINAPI OnEventRecord(PEVENT_RECORD e) {
+    if (!IsEqualGUID(e->EventHeader.ProviderId, kKernelProcessProvider)) return;
+    const USHORT id = e->EventHeader.EventDescriptor.Id;
+    if (id != EventProcessStart && id != EventProcessStop) return;
+    ProcEvent ev{};
+    ev.exit = id == EventProcessStop;
+    ev.time = (ULONGLONG)e->EventHeader.TimeStamp.QuadPart;
+    if (!EventProperty(e, L"ProcessID", ev.pid) || !EventProperty(e, L"CreateTime", ev.created)) return;
+    if (!ev.exit) {
+        EventProperty(e, L"ParentProcessID", ev.ppid);
+        const std::wstring path = DosPath(EventString(e, L"ImageName"));
+        const size_t slash = path.find_last_of(L'\\');
+        ev.name = g_strings.Intern(slash == std::wstring::npos ? std::wstring_view(path) : std::wstring_view(path).substr(slash + 1));
+        ev.path = g_strings.Intern(path);
+    }
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lk(g_events.mu);
+        if (g_events.queue.size() >= kMaxQueuedEvents) return;
+        wake = g_events.queue.empty();
+        g_events.queue.push_back(ev);
+    }
+    if (wake && g_events.notify) g_events.notify(g_events.ctx);
+}
+// False only if `pid` provably names no process (access denied means it exists).
+static bool ProcessAlive(DWORD pid) {
+    HANDLE h = OpenProcess(SYNCHRONIZE, FALSE, pid);
+    if (!h) return GetLastError() != ERROR_INVALID_PARAMETER;
+    const bool alive = WaitForSingleObject(h, 0) == WAIT_TIMEOUT;
+    CloseHandle(h);
+    return alive;
+}
+// Stop our sessions whose instance is gone (crashed before StopProcessEvents). A PID
+// reused since then keeps its session until that process exits too.
+static void StopOrphanedSessions() {
+    struct Slot { EVENT_TRACE_PROPERTIES p; wchar_t logger[kMaxSessionName], file[kMaxSessionName]; };
+    std::vector<Slot> slots(kMaxSessions);
+    std::vector<EVENT_TRACE_PROPERTIES*> props(kMaxSessions);
+    for (ULONG i = 0; i < kMaxSessions; ++i) {
+        Slot& s = slots[i];
+        s.p.Wnode.BufferSize = sizeof(Slot);
+        s.p.LoggerNameOffset = (ULONG)offsetof(Slot, logger);
+        s.p.LogFileNameOffset = (ULONG)offsetof(Slot, file);
+        props[i] = &s.p;
+    }
+    ULONG count = 0;
+    if (QueryAllTracesW(props.data(), kMaxSessions, &count) != ERROR_SUCCESS) return;
+    const size_t prefix = wcslen(kEventSessionPrefix);
+    for (ULONG i = 0; i < count && i < kMaxSessions; ++i) {
+        const std::wstring name(slots[i].logger, wcsnlen(slots[i].logger, kMaxSessionName));
+        if (name.compare(0, prefix, kEventSessionPrefix) || name == g_events.name) continue;
+        wchar_t* end = nullptr;
+        const DWORD pid = wcstoul(name.c_str() + prefix, &end, 10);
+        if (*end || end == name.c_str() + prefix || ProcessAlive(pid)) continue;
+        ControlTraceW(0, name.c_str(), &slots[i].p, EVENT_TRACE_CONTROL_STOP); // the slot is big enough
+    }
+}
+bool StartProcessEvents(void (*notify)(void*), void* ctx) {
+    if (g_events.thread.joinable()) return true;
+    g_events.notify = notify;
+    g_events.ctx = ctx;
+    g_events.name = kEventSessionPrefix + std::to_wstring(GetCurrentProcessId());
+    LoadDeviceMap();
+    StopOrphanedSessions();
+    ULONG err = StartTraceW(&g_events.session, g_events.name.c_str(), SessionProperties());
+    if (err == ERROR_ALREADY_EXISTS) { // ours by name, so left by a dead instance that had our PID
+        ControlTraceW(0, g_events.name.c_str(), SessionProperties(), EVENT_TRACE_CONTROL_STOP);
+        err = StartTraceW(&g_events.session, g_events.name.c_str(), SessionProperties());
+    }
+    if (err != ERROR_SUCCESS) { g_events.session = 0; SetLastError(err); return false; }
+    err = EnableTraceEx2(g_events.session, &kKernelProcessProvider, EVENT_CONTROL_CODE_ENABLE_PROVIDER,
+        TRACE_LEVEL_INFORMATION, kKeywordProcess, 0, 0, nullptr);
+    if (err == ERROR_SUCCESS) {
+        EVENT_TRACE_LOGFILEW log{};
+        log.LoggerName = (LPWSTR)g_events.name.c_str();
+        log.ProcessTraceMode = PROCESS_TRACE_MODE_REAL_TIME | PROCESS_TRACE_MODE_EVENT_RECORD;
+        log.EventRecordCallback = OnEventRecord;
+        g_events.trace = OpenTraceW(&log);
+        if (g_events.trace == INVALID_PROCESSTRACE_HANDLE) err = GetLastError();
+    }
+    if (err != ERROR_SUCCESS) {
+        ControlTraceW(g_events.session, nullptr, SessionProperties(), EVENT_TRACE_CONTROL_STOP);
+        g_events.session = 0;
+        SetLastError(err);
+        return false;
+    }
+    g_events.thread = std::thread([] {
+        TRACEHANDLE t = g_events.trace;
+        ProcessTrace(&t, 1, nullptr, nullptr); // returns once the session is stopped
+    });
+    return true;
+}
+void StopProcessEvents() {
+    if (!g_events.thread.joinable()) return;
+    ControlTraceW(g_events.session, nullptr, SessionProperties(), EVENT_TRACE_CONTROL_STOP);
+    CloseTrace(g_events.trace);
+    g_events.thread.join();
+    g_events.session = 0;
+    g_events.trace = INVALID_PROCESSTRACE_HANDLE;
+    std::lock_guard<std::mutex> lk(g_events.mu);
+    g_events.queue.clear();
+}
+void TakeProcessEvents(std::vector<ProcEvent>& out) {
+    out.clear();
+    std::lock_guard<std::mutex> lk(g_events.mu);
+    out.swap(g_events.queue);
+}
+Proc StartedRow(const ProcEvent& e) {
+    Proc p;
+    p.pid = e.pid; p.ppid = e.ppid; p.created = e.created;
+    p.name = e.name; p.path = e.path;
+    p.fresh = true;
+    return p;
+}
+void MarkExited(Proc& p, ULONGLONG time) {
+    p.exited = time;
+    p.cpu = p.faultRate = p.readRate = p.writeRate = 0;
+}
+bool ApplyProcEvents(std::vector<Proc>& v, const std::vector<ProcEvent>& ev) {
+    if (ev.empty()) return false;
+    std::unordered_map<ProcKey, size_t, ProcKeyHash> at;
+    at.reserve(v.size() + ev.size());
+    for (size_t i = 0; i < v.size(); ++i) at.emplace(KeyOf(v[i]), i);
+    bool changed = false;
+    for (const ProcEvent& e : ev) {
+        auto it = at.find(ProcKey{ e.pid, e.created });
+        if (!e.exit) {
+            if (it != at.end()) continue;
+            at.emplace(ProcKey{ e.pid, e.created }, v.size());
+            v.push_back(StartedRow(e));
+        }
+        else {
+            if (it == at.end() || v[it->second].exited) continue;
+            MarkExited(v[it->second], e.time);
+        }
+        changed = true;
+    }
+    return changed;
+}
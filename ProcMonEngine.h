@@ -0,0 +1,797 @@
+// ProcMonEngine - process enumeration, filtering and export behind ProcMonUI (C++17)
+// Author / Maintainer: Bob Paydar
+//
+// Everything below ListView level: the process table (NtQuerySystemInformation with
+// a ToolHelp fallback), the string pool, snapshot diffs, the process tree, the
+// substring filter, batched actions, JSON/CSV/.pms writers, the .pms reader, history
+// recording, the shared snapshot section and process start/exit events. No windows,
+// messages or UI state, so ProcMonUI (GUI and command line) and ProcMonBench link
+// the same code.
+//
+// Linker inputs: psapi.lib; tdh.lib; advapi32.lib
+
+#pragma once
+
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+
+#include <windows.h>
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <cwchar>
+
+#ifndef PROCESS_SUSPEND_RESUME
+#define PROCESS_SUSPEND_RESUME 0x0800
+#endif
+
+// -------------------- Small helpers --------------------
+void FoldInPlace(std::wstring& s); // towlower, in place
+std::wstring ToLower(std::wstring s);
+// Exact UTF-16 substring test over text the caller has already case-folded (SSE2 where available).
+bool ContainsFolded(const wchar_t* h, size_t hn, const wchar_t* n, size_t nn);
+bool ContainsFolded(const std::wstring& hay, const std::wstring& needle);
+std::wstring LastErrorMessage(DWORD err = GetLastError());
+uint64_t NowFileTime();
+bool LocalSystemTime(uint64_t ft, SYSTEMTIME& st);
+std::wstring FormatFileTime(uint64_t ft); // local time, to the minute
+std::wstring HumanSize(SIZE_T b);
+
+// -------------------- Streaming UTF-8 writer --------------------
+// Encodes UTF-16 straight into a fixed buffer that is flushed with WriteFile, so
+// exports run in constant memory regardless of row count. Escaping scans for the
+// next special character and copies clean runs in one go. Bytes() doubles as a
+// plain buffered writer for the binary snapshot format; the vector form appends to
+// memory instead of a file.
+struct Utf8Writer {
+    explicit Utf8Writer(HANDLE file) : h(file) {}
+    explicit Utf8Writer(std::vector<BYTE>& sink) : h(nullptr), mem(&sink) {}
+    ~Utf8Writer() { Flush(); }
+    Utf8Writer(const Utf8Writer&) = delete;
+    Utf8Writer& operator=(const Utf8Writer&) = delete;
+
+    bool Flush() {
+        if (used && ok && mem) mem->insert(mem->end(), buf, buf + used);
+        else if (used && ok) {
+            DWORD wrote = 0;
+            ok = WriteFile(h, buf, (DWORD)used, &wrote, nullptr) && wrote == used;
+        }
+        used = 0;
+        return ok;
+    }
+    void Bytes(const char* p, size_t n) {
+        while (n) {
+            if (used == sizeof(buf)) Flush();
+            const size_t k = std::min(n, sizeof(buf) - used);
+            memcpy(buf + used, p, k); used += k; p += k; n -= k;
+        }
+    }
+    void Ascii(const char* s) { Bytes(s, strlen(s)); }
+    void Bom() { Bytes("\xEF\xBB\xBF", 3); }
+    void Uint(ULONGLONG v) {
+        char t[24]; size_t i = sizeof(t);
+        do { t[--i] = (char)('0' + v % 10); v /= 10; } while (v);
+        Bytes(t + i, sizeof(t) - i);
+    }
+    void Tenths(unsigned v) { // v / 10 with one decimal
+        Uint(v / 10);
+        const char d[2] = { '.', (char)('0' + v % 10) };
+        Bytes(d, 2);
+    }
+    void Text(const wchar_t* s, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            if (sizeof(buf) - used < 4) Flush();
+            unsigned c = s[i];
+            if (c < 0x80) { buf[used++] = (char)c; continue; }
+            if (c >= 0xD800 && c <= 0xDBFF && i + 1 < n && s[i + 1] >= 0xDC00 && s[i + 1] <= 0xDFFF) {
+                c = 0x10000 + ((c - 0xD800) << 10) + ((unsigned)s[++i] - 0xDC00);
+            }
+            else if (c >= 0xD800 && c <= 0xDFFF) c = 0xFFFD; // lone surrogate
+            if (c < 0x800) {
+                buf[used++] = (char)(0xC0 | (c >> 6));
+            }
+            else if (c < 0x10000) {
+                buf[used++] = (char)(0xE0 | (c >> 12));
+                buf[used++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            }
+            else {
+                buf[used++] = (char)(0xF0 | (c >> 18));
+                buf[used++] = (char)(0x80 | ((c >> 12) & 0x3F));
+                buf[used++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            }
+            buf[used++] = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    void JsonString(std::wstring_view s) {
+        Bytes("\"", 1);
+        size_t run = 0;
+        for (size_t i = 0; i < s.size(); ++i) {
+            const wchar_t c = s[i];
+            if (c >= 32 && c != L'"' && c != L'\\') continue;
+            Text(s.data() + run, i - run); run = i + 1;
+            switch (c) {
+            case L'"': Ascii("\\\""); break;
+            case L'\\':Ascii("\\\\"); break;
+            case L'\b':Ascii("\\b");  break;
+            case L'\f':Ascii("\\f");  break;
+            case L'\n':Ascii("\\n");  break;
+            case L'\r':Ascii("\\r");  break;
+            case L'\t':Ascii("\\t");  break;
+            default: {
+                static const char hex[] = "0123456789abcdef";
+                const char u[6] = { '\\', 'u', '0', '0', hex[(c >> 4) & 0xF], hex[c & 0xF] };
+                Bytes(u, 6);
+            }
+            }
+        }
+        Text(s.data() + run, s.size() - run);
+        Bytes("\"", 1);
+    }
+    void CsvField(std::wstring_view s) { // quoted, embedded quotes doubled
+        Bytes("\"", 1);
+        size_t run = 0;
+        for (size_t i = 0; i < s.size(); ++i) {
+            if (s[i] != L'"') continue;
+            Text(s.data() + run, i + 1 - run); run = i; // the quote is written twice
+        }
+        Text(s.data() + run, s.size() - run);
+        Bytes("\"", 1);
+    }
+
+    HANDLE h;
+    std::vector<BYTE>* mem = nullptr;
+    bool ok = true;
+    size_t used = 0;
+    char buf[64 * 1024];
+};
+// Create `path` and stream into it through `write`, which returns false to abandon
+// the file. A failed or abandoned write removes the partial file; GetLastError()
+// tells why (ERROR_CANCELLED when `write` gave up).
+template <class Fn>
+bool SaveFile(const std::wstring& path, const Fn& write) {
+    HANDLE h = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    bool ok;
+    DWORD err = 0;
+    {
+        Utf8Writer w(h);
+        const bool completed = write(w);
+        ok = w.Flush() && completed;
+        if (!ok) err = completed ? GetLastError() : ERROR_CANCELLED;
+    }
+    CloseHandle(h);
+    if (!ok) { DeleteFileW(path.c_str()); SetLastError(err); }
+    return ok;
+}
+// Same, for UTF-8 text with BOM.
+template <class Fn>
+bool SaveUtf8File(const std::wstring& path, const Fn& write) {
+    return SaveFile(path, [&](Utf8Writer& w) { w.Bom(); return write(w); });
+}
+
+// Default for `progress(done, total)` callbacks: never asks to stop.
+struct NoProgress { bool operator()(size_t, size_t) const { return true; } };
+
+// -------------------- Thread pool fan-out --------------------
+// Run fn(i) for every i in [0, n) on the Windows thread pool plus the calling
+// thread, and wait. Indices are handed out one at a time, so a slow or hung
+// process only delays the thread that drew it.
+static const DWORD kMaxPoolHelpers = 32;
+template <class Fn>
+void ParallelFor(size_t n, const Fn& fn) {
+    struct Shared {
+        const Fn* fn; size_t n;
+        std::atomic<size_t> next{ 0 };
+        std::atomic<long> helpers{ 0 };
+        HANDLE done{};
+        void Drain() { for (size_t i; (i = next.fetch_add(1)) < n;) (*fn)(i); }
+        void Leave() { if (helpers.fetch_sub(1) == 1) SetEvent(done); }
+    } s;
+    s.fn = &fn; s.n = n;
+    const DWORD cores = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    long want = (long)std::min<size_t>(n / 8, (size_t)std::min(cores, kMaxPoolHelpers)) - 1;
+    if (want > 0) s.done = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (s.done) {
+        s.helpers = want;
+        for (long k = 0; k < want; ++k) {
+            auto cb = [](PTP_CALLBACK_INSTANCE inst, PVOID ctx) {
+                CallbackMayRunLong(inst); // per-process queries can block; let the pool add threads
+                Shared* sh = (Shared*)ctx; sh->Drain(); sh->Leave();
+            };
+            if (!TrySubmitThreadpoolCallback(cb, &s, nullptr)) s.Leave();
+        }
+    }
+    s.Drain();
+    if (s.done) { WaitForSingleObject(s.done, INFINITE); CloseHandle(s.done); }
+}
+
+// -------------------- Instrumentation --------------------
+// QPC timers around the refresh stages plus a few counters (View > Show timings in
+// the UI; ProcMonBench counts heap allocations itself, see ProcMonAllocCount.cpp). While g_stats.on is false a
+// StageTimer or Count() is a relaxed load and a branch and nothing is written, so it
+// stays compiled in. Stages keep their latest duration: scan and diff on the worker,
+// sort/filter/list (the ListView update) on the UI thread; paint adds up
+// LVN_ODCACHEHINT/LVN_GETDISPINFO work between refreshes.
+enum Stage : int { StageScan, StageDiff, StageSort, StageFilter, StageList, StagePaint, StageCount };
+static const wchar_t* const kStageNames[StageCount] = { L"scan", L"diff", L"sort", L"filter", L"list", L"paint" };
+enum Counter : int { CountHandles, CountDenied, CounterCount };
+static const wchar_t* const kCounterNames[CounterCount] = { L"handles", L"denied" };
+struct Stats {
+    std::atomic<bool> on{ false };
+    std::atomic<int64_t> ticks[StageCount];    // QPC ticks
+    std::atomic<uint64_t> count[CounterCount]; // running totals
+};
+extern Stats g_stats;
+
+inline bool StatsOn() { return g_stats.on.load(std::memory_order_relaxed); }
+inline void Count(Counter c) {
+    if (StatsOn()) g_stats.count[c].fetch_add(1, std::memory_order_relaxed);
+}
+inline int64_t QpcNow() { LARGE_INTEGER t; QueryPerformanceCounter(&t); return t.QuadPart; }
+double TicksToMs(int64_t t);
+// Times the enclosing scope into `stage`; `accumulate` adds instead of replacing.
+struct StageTimer {
+    explicit StageTimer(Stage s, bool accumulate = false) : stage(s), add(accumulate), t0(StatsOn() ? QpcNow() : 0) {}
+    ~StageTimer() {
+        if (!t0) return;
+        const int64_t dt = QpcNow() - t0;
+        if (add) g_stats.ticks[stage].fetch_add(dt, std::memory_order_relaxed);
+        else g_stats.ticks[stage].store(dt, std::memory_order_relaxed);
+    }
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+    Stage stage; bool add; int64_t t0;
+};
+
+// -------------------- Nt Suspend/Resume/Query --------------------
+using NtSuspendProcess_t = LONG(WINAPI*)(HANDLE);
+using NtResumeProcess_t = LONG(WINAPI*)(HANDLE);
+using NtQuerySystemInformation_t = LONG(WINAPI*)(ULONG, PVOID, ULONG, PULONG);
+using RtlNtStatusToDosError_t = ULONG(WINAPI*)(LONG);
+extern NtSuspendProcess_t pNtSuspendProcess;
+extern NtResumeProcess_t pNtResumeProcess;
+extern NtQuerySystemInformation_t pNtQuerySystemInformation;
+extern RtlNtStatusToDosError_t pRtlNtStatusToDosError;
+void LoadNtFunctions();
+DWORD NtError(LONG st); // NTSTATUS -> Win32 error; 0 for success
+
+// -------------------- String pool --------------------
+// Names and paths are interned for the life of the process: rows carry 32-bit IDs,
+// equal strings share one (a few dozen image names cover most processes), and each
+// string is case-folded once, when first seen. Storage is append-only and never
+// moves, so any thread may read an ID it was handed; only Intern() locks.
+// ID 0 is the empty string.
+struct StringPool {
+    struct Entry { const wchar_t* text; const wchar_t* folded; uint32_t len; };
+    static const uint32_t kBlockBits = 12, kBlock = 1u << kBlockBits, kMaxBlocks = 1024; // up to 4M strings
+    static const size_t kChunk = 64 * 1024; // arena chunk, in wchar_t
+
+    StringPool() { Intern(std::wstring_view()); }
+    // Returns 0 (empty) once the pool is full, and counts the string in Dropped().
+    uint32_t Intern(std::wstring_view s) {
+        std::lock_guard<std::mutex> lk(mu);
+        auto it = ids.find(s);
+        if (it != ids.end()) return it->second;
+        const uint32_t id = count.load(std::memory_order_relaxed);
+        if (id >= kBlock * kMaxBlocks) { dropped.fetch_add(1, std::memory_order_relaxed); return 0; }
+        // text NUL folded NUL, side by side in the current chunk
+        const size_t need = 2 * (s.size() + 1);
+        if (need > left) {
+            const size_t size = std::max(need, kChunk);
+            chunks.emplace_back(new wchar_t[size]);
+            next = chunks.back().get(); left = size;
+        }
+        wchar_t* text = next; next += need; left -= need;
+        wchar_t* folded = text + s.size() + 1;
+        for (size_t i = 0; i < s.size(); ++i) { text[i] = s[i]; folded[i] = (wchar_t)towlower(s[i]); }
+        text[s.size()] = folded[s.size()] = L'\0';
+        auto& block = blocks[id >> kBlockBits];
+        if (!block) block.reset(new Entry[kBlock]);
+        block[id & (kBlock - 1)] = Entry{ text, folded, (uint32_t)s.size() };
+        ids.emplace(std::wstring_view(text, s.size()), id);
+        count.store(id + 1, std::memory_order_release);
+        return id;
+    }
+    const Entry& At(uint32_t id) const { return blocks[id >> kBlockBits][id & (kBlock - 1)]; }
+    std::wstring_view Text(uint32_t id) const { const Entry& e = At(id); return std::wstring_view(e.text, e.len); }
+    std::wstring_view Folded(uint32_t id) const { const Entry& e = At(id); return std::wstring_view(e.folded, e.len); }
+    const wchar_t* CStr(uint32_t id) const { return At(id).text; }
+    uint32_t Count() const { return count.load(std::memory_order_acquire); }
+    // New strings turned away since the pool filled up; they show as empty.
+    uint64_t Dropped() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    std::mutex mu;
+    std::unordered_map<std::wstring_view, uint32_t> ids; // views into the chunks
+    std::unique_ptr<Entry[]> blocks[kMaxBlocks];
+    std::vector<std::unique_ptr<wchar_t[]>> chunks;
+    wchar_t* next = nullptr;
+    size_t left = 0;
+    std::atomic<uint32_t> count{ 0 };
+    std::atomic<uint64_t> dropped{ 0 };
+};
+extern StringPool g_strings;
+
+// -------------------- Process model --------------------
+// A row is fixed-size and trivially copyable: strings live in g_strings, so a
+// snapshot is one allocation and copying rows (exports, buffers) never allocates.
+struct Proc {
+    DWORD pid{}, ppid{};
+    uint32_t name{}, path{}; // g_strings IDs
+    SIZE_T rss{}; // working set bytes
+    ULONGLONG cpuTime{}; // kernel + user, 100ns ticks
+    float cpu{};         // % of all logical cores since the previous snapshot (set by DiffSnapshots)
+    SIZE_T privateBytes{}, commit{};
+    ULONGLONG pageFaults{}, readBytes{}, writeBytes{}; // cumulative
+    float faultRate{}, readRate{}, writeRate{};        // per second since the previous snapshot (set by DiffSnapshots)
+    ULONGLONG created{}; // creation FILETIME as 100ns ticks; (pid, created) identifies a process
+    bool fresh{};        // started since the previous snapshot (row is highlighted)
+    ULONGLONG exited{};  // exit FILETIME from a process event; 0 = running
+    bool lazyPath{};     // path not resolved yet (see RequestPaths)
+};
+
+// Identity of a process instance: PIDs are recycled, (pid, creation time) pairs are not.
+struct ProcKey {
+    DWORD pid{};
+    ULONGLONG created{};
+    bool operator==(const ProcKey& o) const { return pid == o.pid && created == o.created; }
+};
+struct ProcKeyHash {
+    size_t operator()(const ProcKey& k) const { return (size_t)((k.created * 0x9E3779B97F4A7C15ull) ^ k.pid); }
+};
+inline ProcKey KeyOf(const Proc& p) { return ProcKey{ p.pid, p.created }; }
+
+// Keyed difference between two consecutive snapshots.
+struct SnapshotDiff {
+    std::vector<size_t> added, changed; // indices into the new snapshot (changed = a counter moved or a rate fell to 0)
+    std::vector<ProcKey> removed;
+    bool superseded = false;            // UI skipped an intermediate snapshot; lists are incomplete
+    bool Empty() const { return !superseded && added.empty() && changed.empty() && removed.empty(); }
+};
+// `path` too: a rescan that resolves a lazy path changes the row even if no counter did.
+struct Sample {
+    SIZE_T rss, privateBytes, commit;
+    ULONGLONG cpuTime, pageFaults, readBytes, writeBytes;
+    uint32_t path;
+    float cpu, faultRate, readRate, writeRate; // as shown: a row whose rates fall to 0 changed too
+};
+using SampleByKey = std::unordered_map<ProcKey, Sample, ProcKeyHash>;
+inline int CpuTenths(float cpu) { return (int)(cpu * 10.0f + 0.5f); } // as displayed
+// Diff `next` against `prev`, mark newly started processes fresh and turn the
+// cumulative counters into rates over the `secs` since `prev` (0 = no interval yet);
+// CPU % is normalized to `cores`. Afterwards `prev` describes `next`; `scratch` is
+// a spare map kept only for its buckets.
+void DiffSnapshots(SampleByKey& prev, SampleByKey& scratch, std::vector<Proc>& next, SnapshotDiff& d, double secs, double cores);
+
+// Optional counters that cost a per-process call in the ToolHelp fallback, which
+// collects them only when a visible column needs them (the Nt backend gets them
+// for free). CollectPaths resolves every image path not cached yet (one OpenProcess
+// each); without it the Nt backend marks those rows lazyPath instead.
+enum : unsigned { CollectIo = 1, CollectPaths = 2 };
+// Refill `v` with every running process (NtQuerySystemInformation, ToolHelp as the
+// fallback); image paths come from a cache keyed by ProcKey. Call LoadNtFunctions()
+// first. One caller at a time.
+void Snapshot(std::vector<Proc>& v, unsigned collect);
+
+// Lazy paths: rows left lazyPath are resolved on request, on the thread pool, one
+// queue for the process. Results go to the caller through TakePaths and into the
+// path cache, so the next Snapshot() has them.
+struct PathResult { ProcKey key; uint32_t path; }; // path 0: couldn't be resolved
+// Queue `keys`; `notify(ctx)` runs on a pool thread when results arrive to an empty
+// list. Keys already resolved or queued are the caller's to skip.
+void RequestPaths(const std::vector<ProcKey>& keys, void (*notify)(void*), void* ctx);
+void TakePaths(std::vector<PathResult>& out);
+// Drop queued requests and wait for the one in progress; no notify afterwards.
+void StopPathLoader();
+// Resolve every lazy path in `v` on the calling thread (before an export).
+void LoadPaths(std::vector<Proc>& v);
+
+// Process tree over the rows of one snapshot. A PPID only counts if that process
+// was created before the child (an exited parent's PID may now belong to a younger
+// process); rows without a valid parent are roots. Siblings keep `order`.
+struct ProcTree {
+    std::unordered_map<DWORD, uint32_t> rowOf; // PID -> row
+    std::vector<int32_t> parent;             // row of the parent, -1 = root
+    std::vector<uint32_t> childAt, children; // children of r: children[childAt[r] .. childAt[r + 1])
+    std::vector<uint32_t> roots;
+    std::vector<uint32_t> preorder;          // every row once, parents first
+    std::vector<uint32_t> depth;             // 0 for roots
+    std::vector<SIZE_T> subRss;              // subtree totals, the row itself included
+    std::vector<float> subCpu;
+    std::vector<uint32_t> subCount;
+};
+void BuildProcTree(const std::vector<Proc>& v, const std::vector<uint32_t>& order, ProcTree& t);
+// Append the row of `pid` and every row below it in `t`, parents first; false if the
+// snapshot doesn't know `pid`. Iterative, and `seen` (one flag per row, shared across
+// calls) stops a row from being taken twice, so overlapping selections and any
+// damaged tree stay bounded.
+bool CollectTree(DWORD pid, const ProcTree& t, std::vector<char>& seen, std::vector<uint32_t>& rows);
+
+// -------------------- Filter --------------------
+// Substring filter over interned strings: each distinct name or path is tested at
+// most once per needle, however many rows share it. The needle must be case-folded
+// (ToLower); an empty one matches everything.
+struct StringFilter {
+    void SetNeedle(const std::wstring& folded) {
+        if (folded == needle) return;
+        needle = folded;
+        hit.clear();
+    }
+    bool Matches(uint32_t id) {
+        if (id >= hit.size()) hit.resize(g_strings.Count(), -1);
+        signed char& h = hit[id];
+        if (h < 0) {
+            const std::wstring_view s = g_strings.Folded(id);
+            h = ContainsFolded(s.data(), s.size(), needle.data(), needle.size()) ? 1 : 0;
+        }
+        return h != 0;
+    }
+    bool Matches(const Proc& p) { return Matches(p.name) || Matches(p.path); }
+    // Append the rows of `v` listed in `rows` that match, in order.
+    void Narrow(const std::vector<Proc>& v, const std::vector<uint32_t>& rows, std::vector<uint32_t>& out) {
+        for (uint32_t i : rows) if (Matches(v[i])) out.push_back(i);
+    }
+
+    std::wstring needle;
+    std::vector<signed char> hit; // per g_strings ID: -1 untested, else 0/1
+};
+
+// -------------------- Batched actions --------------------
+// Kill/Suspend/Resume on a whole set of processes. Handles are opened in parallel and
+// checked against the snapshot's creation time (a PID reused since then counts as
+// exited). Then the set is processed one tree level at a time, each level in parallel:
+//   suspend  parents first, so nothing left running can start new children
+//   resume   deepest first
+//   kill     everything joins one job object, parents first (so a child started after
+//            that is in the job too), and a single TerminateJobObject takes the group
+//            down. Processes that can't join (e.g. their job forbids nesting) are frozen
+//            parents first and then terminated deepest first, so none can respawn; one
+//            whose termination fails is resumed again before its error is reported.
+// Windows can't hand out the job a process already runs in, hence our own.
+enum Action : int { ActKill = 1, ActSuspend, ActResume };
+struct Victim { DWORD pid; ULONGLONG created; uint32_t depth; }; // created 0 = unknown
+// Per-victim result: 0 done, ERROR_NOT_FOUND already exited, WAIT_TIMEOUT killed but
+// still running after kKillWaitMs, else the Win32 error. `progress` hears after each level.
+static const DWORD kKillWaitMs = 2000;
+std::wstring ActionOutcome(DWORD e); // "done", "access denied", ...
+
+// fn(k) for each victim, one depth level at a time (deepest first if `up`), in
+// parallel within a level; then progress(victims so far, all). `v` is sorted by depth.
+template <class Fn, class Progress = NoProgress>
+void ByLevel(const std::vector<Victim>& v, bool up, const Fn& fn, const Progress& progress = Progress()) {
+    std::vector<size_t> at{ 0 }; // level boundaries
+    for (size_t k = 1; k <= v.size(); ++k) if (k == v.size() || v[k].depth != v[k - 1].depth) at.push_back(k);
+    size_t done = 0;
+    for (size_t l = 0; l + 1 < at.size(); ++l) {
+        const size_t lv = up ? at.size() - 2 - l : l, from = at[lv];
+        ParallelFor(at[lv + 1] - from, [&](size_t k) { fn(from + k); });
+        done += at[lv + 1] - from;
+        progress(done, v.size());
+    }
+}
+template <class Progress = NoProgress>
+std::vector<DWORD> RunActions(int action, std::vector<Victim>& v, const Progress& progress = Progress()) {
+    std::stable_sort(v.begin(), v.end(), [](const Victim& a, const Victim& b) { return a.depth < b.depth; });
+    const size_t n = v.size();
+    std::vector<DWORD> err(n, 0);
+    std::vector<HANDLE> h(n, nullptr);
+    const DWORD base = PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE;
+    const DWORD access = base | (action == ActKill ? PROCESS_TERMINATE | PROCESS_SET_QUOTA | PROCESS_SUSPEND_RESUME : PROCESS_SUSPEND_RESUME);
+    ParallelFor(n, [&](size_t k) {
+        HANDLE p = OpenProcess(access, FALSE, v[k].pid);
+        if (!p && action == ActKill) p = OpenProcess(base | PROCESS_TERMINATE, FALSE, v[k].pid); // no job, no freeze
+        if (!p) { const DWORD e = GetLastError(); err[k] = e == ERROR_INVALID_PARAMETER ? ERROR_NOT_FOUND : e; return; }
+        FILETIME c{}, x{}, kt{}, ut{};
+        const bool gone = WaitForSingleObject(p, 0) == WAIT_OBJECT_0 ||
+            (v[k].created && GetProcessTimes(p, &c, &x, &kt, &ut) && (((ULONGLONG)c.dwHighDateTime << 32) | c.dwLowDateTime) != v[k].created);
+        if (gone) { CloseHandle(p); err[k] = ERROR_NOT_FOUND; return; }
+        h[k] = p;
+    });
+    auto status = [&](size_t k, LONG(WINAPI* op)(HANDLE)) { err[k] = op ? NtError(op(h[k])) : ERROR_PROC_NOT_FOUND; };
+    if (action == ActSuspend) ByLevel(v, false, [&](size_t k) { if (h[k]) status(k, pNtSuspendProcess); }, progress);
+    else if (action == ActResume) ByLevel(v, true, [&](size_t k) { if (h[k]) status(k, pNtResumeProcess); }, progress);
+    else {
+        std::vector<char> joined(n, 0);
+        HANDLE job = CreateJobObjectW(nullptr, nullptr);
+        if (job) {
+            ByLevel(v, false, [&](size_t k) { if (h[k]) joined[k] = AssignProcessToJobObject(job, h[k]) ? 1 : 0; });
+            const bool any = std::find(joined.begin(), joined.end(), 1) != joined.end();
+            if (any && !TerminateJobObject(job, 1)) std::fill(joined.begin(), joined.end(), 0);
+            CloseHandle(job);
+        }
+        std::vector<char> frozen(n, 0); // suspended here, so a failed kill must resume it
+        if (pNtSuspendProcess) ByLevel(v, false, [&](size_t k) { if (h[k] && !joined[k]) frozen[k] = pNtSuspendProcess(h[k]) >= 0; });
+        ByLevel(v, true, [&](size_t k) {
+            if (!h[k] || joined[k] || TerminateProcess(h[k], 1)) return;
+            err[k] = GetLastError();
+            if (frozen[k] && pNtResumeProcess) pNtResumeProcess(h[k]);
+        }, progress);
+        // Termination completes asynchronously; confirm that the victims are gone.
+        const ULONGLONG deadline = GetTickCount64() + kKillWaitMs;
+        for (size_t k = 0; k < n; ++k) {
+            if (!h[k] || err[k]) continue;
+            const ULONGLONG now = GetTickCount64();
+            if (WaitForSingleObject(h[k], now < deadline ? (DWORD)(deadline - now) : 0) != WAIT_OBJECT_0) err[k] = WAIT_TIMEOUT;
+        }
+    }
+    for (HANDLE p : h) if (p) CloseHandle(p);
+    return err;
+}
+
+// -------------------- Output builders --------------------
+// `progress(done, total)` is polled every kProgressRows rows; returning false stops
+// the export and the builder returns false.
+static const size_t kProgressRows = 256;
+
+template <class Progress = NoProgress>
+bool WriteJson(Utf8Writer& w, const std::vector<Proc>& v, const Progress& progress = Progress()) {
+    w.Ascii("{\"processes\":[");
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (i % kProgressRows == 0 && !progress(i, v.size())) return false;
+        const auto& p = v[i];
+        w.Ascii("{\"pid\":"); w.Uint(p.pid);
+        w.Ascii(",\"ppid\":"); w.Uint(p.ppid);
+        w.Ascii(",\"name\":"); w.JsonString(g_strings.Text(p.name));
+        w.Ascii(",\"path\":"); w.JsonString(g_strings.Text(p.path));
+        w.Ascii(",\"rss_bytes\":"); w.Uint(p.rss);
+        w.Ascii(",\"cpu_percent\":"); w.Tenths((unsigned)CpuTenths(p.cpu));
+        w.Ascii(i + 1 < v.size() ? "}," : "}");
+    }
+    w.Ascii("]}\n");
+    return progress(v.size(), v.size());
+}
+template <class Progress = NoProgress>
+bool WriteCsv(Utf8Writer& w, const std::vector<Proc>& v, const Progress& progress = Progress()) {
+    w.Ascii("PID,PPID,RSS_BYTES,Name,Path,CPU_PERCENT\n"); // new columns go last: readers may index by position
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (i % kProgressRows == 0 && !progress(i, v.size())) return false;
+        const auto& p = v[i];
+        w.Uint(p.pid); w.Ascii(",");
+        w.Uint(p.ppid); w.Ascii(",");
+        w.Uint(p.rss); w.Ascii(",");
+        w.CsvField(g_strings.Text(p.name)); w.Ascii(",");
+        w.CsvField(g_strings.Text(p.path)); w.Ascii(",");
+        w.Tenths((unsigned)CpuTenths(p.cpu)); w.Ascii("\n");
+    }
+    return progress(v.size(), v.size());
+}
+
+// -------------------- Binary snapshot --------------------
+// Compact columnar archive (.pms): a header, a section directory, one fixed-width
+// column per field and an interned UTF-16 string table. Readers map the file and
+// index the columns in place; nothing is parsed on open.
+//
+// Layout (little-endian; every section starts 8-byte aligned):
+//   PmsHeader | PmsSection[sections] | section data...
+//   PID, PPID      u32 per row       NAME, PATH  u32 string ID per row
+//   RSS, CREATED   u64 per row       STROFF      u32 [strings + 1], offsets into STRDATA
+//   CPUTIME        u64 per row (100ns; optional, absent in older files)
+//   PRIVATE, COMMIT, FAULTS, READ, WRITE
+//                  u64 per row: private bytes, commit, page faults, I/O read and
+//                  write bytes (cumulative; optional, absent in older files)
+//   STRDATA        each distinct string once, UTF-16, NUL-terminated
+//   HISTORY        optional recorded log (see History recording): u64 keyframe FILETIME,
+//                  u32 frame count, u32 counters per entry (0 in older files = 2), then
+//                  the encoded frames; the rows above are its keyframe
+// Readers skip section IDs they don't know, so later versions can add sections.
+static const uint32_t kPmsMagic = 0x53534D50; // "PMSS"
+static const uint16_t kPmsVersion = 1;
+struct PmsHeader {
+    uint32_t magic;
+    uint16_t version, headerSize; // headerSize = offset of the section directory
+    uint32_t rows, strings;
+    uint64_t timestamp;           // FILETIME (UTC) of the export
+    uint32_t host;                // string ID of the computer name
+    uint32_t sections;            // directory entries
+};
+struct PmsSection { uint32_t id, reserved; uint64_t offset, size; };
+static_assert(sizeof(PmsHeader) == 32 && sizeof(PmsSection) == 24, "on-disk layout");
+enum : uint32_t { PmsPid = 1, PmsPpid, PmsRss, PmsCreated, PmsName, PmsPath, PmsStrOff, PmsStrData, PmsHistory, PmsCpuTime,
+    PmsPrivate, PmsCommit, PmsFaults, PmsRead, PmsWrite };
+inline uint64_t PmsAlign(uint64_t n) { return (n + 7) & ~(uint64_t)7; }
+
+// A recorded history log, as stored in the HISTORY section. Frames refer to
+// `strings` by index; WriteSnapshot interns them first so the IDs carry over.
+struct HistoryLog {
+    uint64_t start = 0;                // FILETIME of the keyframe
+    uint32_t frames = 0;
+    uint32_t counters = 0;             // counters per entry (see History recording)
+    std::vector<BYTE> bytes;           // encoded frames, back to back
+    std::vector<std::wstring> strings; // string table the frames index into
+};
+struct PmsHistoryHeader { uint64_t start; uint32_t frames, counters; };
+
+// `hist`, if given, is written as the HISTORY section with `v` as its keyframe.
+template <class Progress = NoProgress>
+bool WriteSnapshot(Utf8Writer& w, const std::vector<Proc>& v, const Progress& progress = Progress(), const HistoryLog* hist = nullptr) {
+    // Intern names and paths; the views point into g_strings, `hist` and `host`, which outlive them.
+    std::unordered_map<std::wstring_view, uint32_t> ids;
+    std::vector<std::wstring_view> strs;
+    auto intern = [&](std::wstring_view s) {
+        auto r = ids.emplace(s, (uint32_t)strs.size());
+        if (r.second) strs.push_back(s);
+        return r.first->second;
+    };
+    if (hist) for (const auto& s : hist->strings) intern(s); // distinct, so ID i stays i
+    wchar_t host[MAX_COMPUTERNAME_LENGTH + 1] = L"";
+    DWORD hostLen = MAX_COMPUTERNAME_LENGTH + 1;
+    if (!GetComputerNameW(host, &hostLen)) hostLen = 0;
+    PmsHeader hdr{};
+    hdr.host = intern(std::wstring_view(host, hostLen));
+    std::vector<uint32_t> name(v.size()), path(v.size());
+    for (size_t i = 0; i < v.size(); ++i) { name[i] = intern(g_strings.Text(v[i].name)); path[i] = intern(g_strings.Text(v[i].path)); }
+    uint64_t chars = 0;
+    for (auto s : strs) chars += s.size() + 1;
+
+    const uint64_t n = v.size();
+    PmsSection dir[] = {
+        { PmsPid, 0, 0, n * 4 }, { PmsPpid, 0, 0, n * 4 }, { PmsRss, 0, 0, n * 8 }, { PmsCreated, 0, 0, n * 8 },
+        { PmsCpuTime, 0, 0, n * 8 }, { PmsName, 0, 0, n * 4 }, { PmsPath, 0, 0, n * 4 },
+        { PmsPrivate, 0, 0, n * 8 }, { PmsCommit, 0, 0, n * 8 }, { PmsFaults, 0, 0, n * 8 },
+        { PmsRead, 0, 0, n * 8 }, { PmsWrite, 0, 0, n * 8 },
+        { PmsStrOff, 0, 0, (strs.size() + 1) * 4 }, { PmsStrData, 0, 0, chars * sizeof(wchar_t) },
+        { PmsHistory, 0, 0, hist ? sizeof(PmsHistoryHeader) + hist->bytes.size() : 0 },
+    };
+    const uint32_t sections = hist ? 15 : 14;
+    uint64_t at = PmsAlign(sizeof(hdr) + sections * sizeof(PmsSection));
+    for (uint32_t k = 0; k < sections; ++k) { dir[k].offset = at; at = PmsAlign(at + dir[k].size); }
+    hdr.magic = kPmsMagic; hdr.version = kPmsVersion; hdr.headerSize = (uint16_t)sizeof(hdr);
+    hdr.rows = (uint32_t)n; hdr.strings = (uint32_t)strs.size();
+    hdr.timestamp = NowFileTime();
+    hdr.sections = sections;
+
+    static const char zeros[8] = {};
+    auto pad = [&](uint64_t size) { w.Bytes(zeros, (size_t)(PmsAlign(size) - size)); };
+    w.Bytes((const char*)&hdr, sizeof(hdr));
+    w.Bytes((const char*)dir, sections * sizeof(PmsSection));
+    pad(sizeof(hdr) + sections * sizeof(PmsSection));
+
+    size_t done = 0;
+    const size_t total = 12 * v.size();
+    auto column = [&](const PmsSection& s, auto get) {
+        for (size_t i = 0; i < v.size(); ++i, ++done) {
+            if (done % kProgressRows == 0 && !progress(done, total)) return false;
+            const auto x = get(i);
+            w.Bytes((const char*)&x, sizeof(x));
+        }
+        pad(s.size);
+        return true;
+    };
+    if (!column(dir[0], [&](size_t i) { return (uint32_t)v[i].pid; }) ||
+        !column(dir[1], [&](size_t i) { return (uint32_t)v[i].ppid; }) ||
+        !column(dir[2], [&](size_t i) { return (uint64_t)v[i].rss; }) ||
+        !column(dir[3], [&](size_t i) { return (uint64_t)v[i].created; }) ||
+        !column(dir[4], [&](size_t i) { return (uint64_t)v[i].cpuTime; }) ||
+        !column(dir[5], [&](size_t i) { return name[i]; }) ||
+        !column(dir[6], [&](size_t i) { return path[i]; }) ||
+        !column(dir[7], [&](size_t i) { return (uint64_t)v[i].privateBytes; }) ||
+        !column(dir[8], [&](size_t i) { return (uint64_t)v[i].commit; }) ||
+        !column(dir[9], [&](size_t i) { return (uint64_t)v[i].pageFaults; }) ||
+        !column(dir[10], [&](size_t i) { return (uint64_t)v[i].readBytes; }) ||
+        !column(dir[11], [&](size_t i) { return (uint64_t)v[i].writeBytes; })) return false;
+
+    uint32_t off = 0;
+    for (auto s : strs) { w.Bytes((const char*)&off, sizeof(off)); off += (uint32_t)s.size() + 1; }
+    w.Bytes((const char*)&off, sizeof(off));
+    pad(dir[12].size);
+    for (auto s : strs) { w.Bytes((const char*)s.data(), s.size() * sizeof(wchar_t)); w.Bytes(zeros, sizeof(wchar_t)); }
+    pad(dir[13].size);
+    if (hist) {
+        const PmsHistoryHeader hh{ hist->start, hist->frames, hist->counters };
+        w.Bytes((const char*)&hh, sizeof(hh));
+        w.Bytes((const char*)hist->bytes.data(), hist->bytes.size());
+        pad(dir[14].size);
+    }
+    return progress(total, total);
+}
+
+// An opened .pms file. Column pointers point into the read-only view; `folded`
+// and `hit` are the filter's only copies, built on demand. One thread at a time.
+struct SnapshotArchive {
+    const BYTE* base{};
+    uint64_t size{};
+    const PmsHeader* hdr{};
+    const uint32_t* pid{}, * ppid{}, * name{}, * path{}, * strOff{};
+    const uint64_t* rss{}, * created{}, * cpuTime{}; // cpuTime may be null
+    const uint64_t* privateBytes{}, * commit{}, * pageFaults{}, * readBytes{}, * writeBytes{}; // may be null
+    const wchar_t* strData{};
+    uint64_t strChars{};
+    uint32_t historyFrames{};
+    std::wstring file;
+    std::vector<wchar_t> folded;  // case-folded copy of STRDATA
+    std::vector<signed char> hit; // per string ID: -1 untested, else 0/1 for `hitNeedle`
+    std::wstring hitNeedle;
+};
+// Map `file` read-only into `a` and locate its columns. GetLastError() says why
+// it failed (ERROR_BAD_FORMAT for files that aren't a readable snapshot).
+bool MapArchive(const std::wstring& file, SnapshotArchive& a);
+
+// -------------------- History recording --------------------
+// A bounded, delta-encoded log of every snapshot (format and budget in
+// ProcMonEngine.cpp). Thread-safe.
+void SetRecording(bool on);
+// Worker thread, after DiffSnapshots: append `v` as a frame (or as the keyframe).
+void RecordHistory(const std::vector<Proc>& v, const SnapshotDiff& d);
+// The log and its keyframe, for writing out; false if nothing was recorded yet.
+bool CopyHistory(std::vector<Proc>& keyframe, HistoryLog& log);
+
+// -------------------- Shared snapshot --------------------
+// With View > Share snapshots (or --share) every snapshot the worker takes is also
+// published as a .pms image in the pagefile-backed section Local\ProcMonUI.Snapshot,
+// so local collectors get the process table without enumerating the system themselves.
+// Layout: ShmHeader (64 bytes), then the image. `seq` is a seqlock: the writer makes it
+// odd, rewrites the image, then makes it even again. A reader maps the section
+// read-only (FILE_MAP_READ) and retries until it copied a stable version:
+//   do { s = seq; if (s & 1) continue; copy size bytes from offset 64; barrier; } while (seq != s);
+// then parses the copy like a .pms file. Only the instance holding the mutex
+// Local\ProcMonUI.Snapshot.Writer publishes. Turning sharing off withdraws the image
+// (size 0, seq bumped twice) and closes the section and mutex. Readers may keep the section alive after the writer exits (or crashes), so the
+// next instance to take the mutex reattaches to the section and takes it over.
+// Both objects get an explicit DACL: full access for the writer's user, SECTION_MAP_READ
+// for everyone else. A section that already exists is only taken over if its owner and
+// DACL are exactly those, so one squatted by another process is refused.
+static const wchar_t kShmName[] = L"Local\\ProcMonUI.Snapshot";
+static const wchar_t kShmWriterMutex[] = L"Local\\ProcMonUI.Snapshot.Writer";
+static const uint32_t kShmMagic = 0x48534D50; // "PMSH"
+static const uint32_t kShmVersion = 1;
+static const uint64_t kShmBytes = 32ull << 20; // header + image; ~40k processes fit
+struct ShmHeader {
+    uint32_t magic, version;
+    volatile LONG64 seq;   // odd while an update is in progress
+    uint64_t capacity;     // bytes available for the image
+    uint64_t size;         // bytes in the current image (0 = nothing published yet)
+    uint64_t timestamp;    // FILETIME of the current image
+    uint64_t published;    // images published so far
+    uint32_t writerPid;
+    uint32_t skipped;      // snapshots too large for the section (not published)
+    uint64_t reserved;
+};
+static_assert(sizeof(ShmHeader) == 64, "ShmHeader layout is part of the protocol");
+// False (with GetLastError) if the section can't be created, ERROR_ALREADY_EXISTS if
+// another live instance owns it, or ERROR_ACCESS_DENIED if the existing section wasn't
+// created by this user with our DACL. Open and close on the same thread (the mutex is
+// owned by it); close waits for a publish in progress, then withdraws the image.
+bool OpenSharedSnapshot();
+void CloseSharedSnapshot();
+// Publish `v` if the section is open; one writer thread at a time.
+void PublishSnapshot(const std::vector<Proc>& v);
+
+// -------------------- Process events --------------------
+// Start and exit notifications from an ETW real-time session (ProcMonUI.ProcessEvents.<pid>,
+// one per instance) on the Microsoft-Windows-Kernel-Process provider, so processes that come and go
+// between snapshots are still seen. Starting the session needs administrator rights
+// (or Performance Log Users); without it callers simply keep polling with Snapshot().
+struct ProcEvent {
+    bool exit;
+    DWORD pid, ppid;     // ppid: starts only
+    ULONGLONG created;   // with pid, the ProcKey Snapshot() reports
+    ULONGLONG time;      // FILETIME of the event
+    uint32_t name, path; // g_strings IDs (starts only)
+};
+// `notify(ctx)` runs on the session's thread when events arrive to an empty queue.
+// False (with GetLastError) if the session can't be started.
+bool StartProcessEvents(void (*notify)(void*), void* ctx);
+void StopProcessEvents();
+// Move the queued events, oldest first, into `out`.
+void TakeProcessEvents(std::vector<ProcEvent>& out);
+// Starts append a fresh row unless the process is listed; exits stamp `exited` on
+// their row and zero its rates. No row is removed. Returns false if nothing changed.
+bool ApplyProcEvents(std::vector<Proc>& v, const std::vector<ProcEvent>& ev);
+// The pieces of ApplyProcEvents, for callers that keep their own index of `v`.
+Proc StartedRow(const ProcEvent& e); // fresh, no counters until the next snapshot
+void MarkExited(Proc& p, ULONGLONG time);
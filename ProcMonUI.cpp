@@ -2,62 +2,107 @@
 // Author / Maintainer: Bob Paydar
 //
 // Features:
-//   - Lists all running processes: PID, PPID, memory usage (RSS), name, full path.
+//   - Lists all running processes: PID, PPID, CPU %, memory usage (RSS), name, full path;
+//     optional columns (right-click the header): private bytes, commit, page faults/s,
+//     read/write bytes/s.
+//   - Click a column header to sort by it (again to reverse); kept across refreshes.
 //   - Search box with live filtering by name or path.
 //   - Buttons: Refresh, Kill, Suspend, Resume, Export JSON, Export CSV.
+//   - Multi-select (Ctrl/Shift-click); actions apply to every selected row shown.
 //   - "Tree" checkbox to apply actions recursively to children.
-//   - Auto-refresh the list after any button click.
-//   - Real status bar at the bottom with fixed text: "Ready - Bob Paydar".
-//   - No background auto-refresh/timers (never blocks user).
+//   - View > Process tree: rows indented under their parents; subtrees collapse (Left/-,
+//     double-click) and a collapsed node shows its subtree's total RSS and CPU %.
+//   - Refresh rescans in the background; only rows that changed are repainted,
+//     selection is kept, and newly started processes are highlighted.
+//   - Kill/Suspend/Resume run in the background and report per-PID outcomes (done,
+//     access denied, already exited, ...) in the status bar; only the victims are
+//     re-checked afterwards, with no full rescan.
+//   - Real status bar at the bottom with fixed text: "Ready - Bob Paydar"
+//     (temporarily replaced by export progress while an export runs).
+//   - Optional "Show timings" (View menu): per-stage refresh times (scan, diff, sort,
+//     filter, list, paint) and handle/access-denied counts in a second status
+//     bar part; "Copy stats" puts them on the clipboard as name/value lines.
+//   - File menu: export the visible rows as a compact binary snapshot (.pms), or open
+//     one read-only (memory-mapped; actions are disabled until Close snapshot).
+//   - Optional "Record history" (View menu): a bounded, delta-encoded log of every
+//     snapshot; File > Save history writes it, and full logs spill to disk as .pms.
+//   - Optional "Live update" (View menu): the worker rescans on an adaptive interval
+//     capped at ~5% of one core, backing off while the window is minimized/occluded.
+//     Off by default; snapshots always run on a worker thread (never blocks user).
+//   - Optional "Share snapshots" (View menu, or --share headless): the latest snapshot
+//     is published in a named shared-memory section for local collectors.
+//   - Optional "Track starts/exits" (View menu, administrator): process starts and exits
+//     show up as they happen; exited processes stay grayed for a few seconds.
 //
 // Design/Notes:
 //   - Pure Win32 API (no MFC/WTL). All UI created in code (no .rc file).
-//   - Process enumeration via ToolHelp32 + PSAPI for memory usage.
+//   - Command-line switches (--json/--csv/--binary, --watch, --kill-tree) run the same
+//     engine headless, streaming to stdout, before any window or control is created.
+//   - Shared snapshots are .pms images in Local\ProcMonUI.Snapshot behind a seqlock
+//     version counter: one writer (whoever holds a named mutex, so a crashed writer's
+//     section is taken over), any number of readers, no reader locks or handles.
+//   - Process enumeration via NtQuerySystemInformation(SystemProcessInformation) in a
+//     single call (ToolHelp32 + PSAPI as fallback), on a dedicated worker thread;
+//     results are swapped into g.all on WM_APP_SNAPSHOT. CPU % is derived there from
+//     the kernel+user time delta between snapshots, normalized to all logical cores.
+//   - Start/exit tracking consumes Microsoft-Windows-Kernel-Process events from a
+//     real-time ETW session and patches g.all in batches; snapshots then reconcile.
+//     In the flat view a batch inserts, moves or cuts out only the rows it names (by
+//     binary search in the sorted index lists) and repaints from the first one down.
+//   - Image paths (one OpenProcess each) are lazy: a scan reuses cached ones and leaves
+//     the rest unresolved unless a filter, path sort, history or sharing needs them all.
+//     Rows in the ListView's cache-hint range are resolved on a pool work queue and
+//     patched into g.all by key, so the cost follows what is on screen.
+//   - In the ToolHelp fallback, per-process handles (limited query access) are cached
+//     by PID for the process's lifetime; a thread-pool wait on each closes it when the
+//     process exits. The native backend opens a process once, for its path.
+//   - Virtual (LVS_OWNERDATA) ListView: rows are served from g.filtered on demand,
+//     so refresh/filter cost scales with visible rows, not with process count.
+//   - Rows are fixed-size records; names/paths are IDs into g_strings, a process-wide
+//     pool that stores and case-folds each distinct string once. The filter tests
+//     each distinct string once per needle rather than every row.
+//   - The tree (g.tree) is rebuilt from g.order once per snapshot, with subtree totals
+//     computed bottom-up; the tree view only walks into expanded nodes. Tree actions
+//     walk the same validated tree iteratively, each process at most once.
+//   - Sorting permutes g.order (indices into g.all) on one integer key per row; rows
+//     are never moved. g.filtered is a subsequence of g.order. Typing more characters narrows the
+//     previous match set; Backspace pops back to a remembered coarser level.
 //   - Suspend/Resume via NtSuspendProcess/NtResumeProcess loaded from ntdll.
-//   - JSON/CSV exports encoded UTF-8 with BOM.
-//   - Build in Visual Studio 2019/2022, /std:c++17, /SUBSYSTEM:WINDOWS.
+//   - Actions run as a batch, one tree level at a time and in parallel within a level;
+//     a kill puts the victims in one job object and ends them with TerminateJobObject.
+//   - JSON/CSV exports encoded UTF-8 with BOM, streamed through a fixed 64 KB buffer
+//     on a background thread from a copy of the visible rows; cancellable.
+//   - Binary snapshots are columnar (fixed-width PID/PPID/RSS columns plus an interned
+//     UTF-16 string table) so an opened file is served straight from the mapping.
+//   - The engine (enumeration, string pool, tree, filter kernel, exports, snapshot
+//     format, history, shared section) is ProcMonEngine.h/.cpp, with no UI code;
+//     ProcMonBench.cpp benchmarks it on its own.
+//   - Build with CMakeLists.txt (the engine as a static library, linked into ProcMonUI
+//     and ProcMonBench), or in Visual Studio 2019/2022, /std:c++17, /SUBSYSTEM:WINDOWS,
+//     from ProcMonUI.cpp + ProcMonEngine.cpp (see README).
 //
-// Linker inputs: psapi.lib; comctl32.lib; shlwapi.lib
+// Linker inputs: psapi.lib; tdh.lib; advapi32.lib; comctl32.lib; shlwapi.lib
 // Manifest: enable Common Controls v6 for visual styles.
 
-#ifndef UNICODE
-#define UNICODE
-#endif
-#ifndef _UNICODE
-#define _UNICODE
-#endif
-#ifndef NOMINMAX
-#define NOMINMAX
-#endif
-
-#include <windows.h>
+#include "ProcMonEngine.h"
+
+#include <windowsx.h>
 #include <commctrl.h>
-#include <psapi.h>
-#include <tlhelp32.h>
-#include <processthreadsapi.h>
 #include <shellapi.h>
 #include <shlwapi.h>
 #include <sal.h>
 
-#include <string>
-#include <vector>
-#include <unordered_map>
-#include <algorithm>
-#include <sstream>
-#include <fstream>
-#include <iomanip>
+#include <unordered_set>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 
-#pragma comment(lib, "psapi.lib")
 #pragma comment(lib, "comctl32.lib")
 #pragma comment(lib, "shlwapi.lib")
 
 // Common Controls v6 for visual styles
 #pragma comment(linker,"/manifestdependency:\"type='win32' name='Microsoft.Windows.Common-Controls' version='6.0.0.0' processorArchitecture='*' publicKeyToken='6595b64144ccf1df' language='*'\"")
 
-#ifndef PROCESS_SUSPEND_RESUME
-#define PROCESS_SUSPEND_RESUME 0x0800
-#endif
-
 // Forward declaration
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 
@@ -75,191 +120,90 @@ enum : int {
     IDC_LIST = 1100,
     IDC_STATUS = 1200
 };
-
-// -------------------- Small helpers --------------------
-static std::wstring ToLower(std::wstring s) {
-    std::transform(s.begin(), s.end(), s.begin(), [](wchar_t c) { return (wchar_t)towlower(c); });
-    return s;
-}
-static bool IContains(const std::wstring& hay, const std::wstring& needle) {
-    return ToLower(hay).find(ToLower(needle)) != std::wstring::npos;
-}
-static std::wstring LastErrorMessage(DWORD err = GetLastError()) {
-    if (err == 0) return L"OK";
-    LPWSTR buf = nullptr;
-    DWORD len = FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-        nullptr, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPWSTR)&buf, 0, nullptr);
-    std::wstring msg = (len && buf) ? std::wstring(buf, len) : L"(unknown)";
-    if (buf) LocalFree(buf);
-    while (!msg.empty() && (msg.back() == L'\r' || msg.back() == L'\n')) msg.pop_back();
-    return msg;
-}
-static std::wstring HumanSize(SIZE_T b) {
-    const wchar_t* u[] = { L"B", L"KB", L"MB", L"GB", L"TB" };
-    double d = (double)b; int i = 0;
-    while (d >= 1024.0 && i < 4) { d /= 1024.0; ++i; }
-    std::wstringstream ss; ss << std::fixed << std::setprecision(i ? 1 : 0) << d << L" " << u[i];
-    return ss.str();
-}
-static std::wstring JsonEscape(const std::wstring& s) {
-    std::wstringstream o;
-    for (wchar_t c : s) {
-        switch (c) {
-        case L'"': o << L"\\\""; break;
-        case L'\\':o << L"\\\\"; break;
-        case L'\b':o << L"\\b";  break;
-        case L'\f':o << L"\\f";  break;
-        case L'\n':o << L"\\n";  break;
-        case L'\r':o << L"\\r";  break;
-        case L'\t':o << L"\\t";  break;
-        default:
-            if (c < 32) { o << L"\\u" << std::setw(4) << std::setfill(L'0') << std::hex << (int)c << std::dec; }
-            else o << c;
-        }
-    }
-    return o.str();
-}
-static std::wstring CsvEscape(const std::wstring& s) {
-    std::wstring out; out.reserve(s.size() + 8);
-    for (wchar_t c : s) { out += (c == L'"') ? L"""" : std::wstring(1, c); }
-    return out;
-}
-static std::string WToUtf8(const std::wstring& ws) {
-    if (ws.empty()) return {};
-    int len = WideCharToMultiByte(CP_UTF8, 0, ws.c_str(), (int)ws.size(), nullptr, 0, nullptr, nullptr);
-    std::string out; out.resize(len);
-    WideCharToMultiByte(CP_UTF8, 0, ws.c_str(), (int)ws.size(), &out[0], len, nullptr, nullptr);
-    return out;
-}
-static bool SaveUtf8File(const std::wstring& path, const std::wstring& content, bool bom = true) {
-    std::ofstream ofs(path, std::ios::binary);
-    if (!ofs) return false;
-    if (bom) { unsigned char B[3] = { 0xEF,0xBB,0xBF }; ofs.write((char*)B, 3); }
-    auto u8 = WToUtf8(content);
-    ofs.write(u8.data(), (std::streamsize)u8.size());
-    return true;
-}
-
-// -------------------- Nt Suspend/Resume --------------------
-using NtSuspendProcess_t = LONG(WINAPI*)(HANDLE);
-using NtResumeProcess_t = LONG(WINAPI*)(HANDLE);
-static NtSuspendProcess_t pNtSuspendProcess = nullptr;
-static NtResumeProcess_t  pNtResumeProcess = nullptr;
-static void LoadNtFunctions() {
-    HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
-    if (!ntdll) return;
-    pNtSuspendProcess = (NtSuspendProcess_t)GetProcAddress(ntdll, "NtSuspendProcess");
-    pNtResumeProcess = (NtResumeProcess_t)GetProcAddress(ntdll, "NtResumeProcess");
-}
-
-// -------------------- Process model --------------------
-struct Proc {
-    DWORD pid{}, ppid{};
-    std::wstring name, path;
-    SIZE_T rss{}; // working set bytes
+// Menu commands
+enum : int {
+    IDM_VIEW_LIVE = 2000,
+    IDM_VIEW_RECORD = 2001,
+    IDM_VIEW_TREE = 2002,
+    IDM_VIEW_SHARE = 2003,
+    IDM_VIEW_STATS = 2004,
+    IDM_VIEW_COPY_STATS = 2005,
+    IDM_VIEW_EVENTS = 2006,
+    IDM_FILE_OPEN = 2010,
+    IDM_FILE_EXPORT = 2011,
+    IDM_FILE_CLOSE = 2012,
+    IDM_FILE_HISTORY = 2013,
+    IDM_COLUMN_FIRST = 2100 // + Column, header context menu
 };
 
-// Snapshot of processes
-static std::vector<Proc> Snapshot() {
-    std::vector<Proc> v;
-    HANDLE snap = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
-    if (snap == INVALID_HANDLE_VALUE) return v;
-
-    PROCESSENTRY32W pe; pe.dwSize = sizeof(pe);
-    if (Process32FirstW(snap, &pe)) {
-        do {
-            Proc p; p.pid = pe.th32ProcessID; p.ppid = pe.th32ParentProcessID; p.name = pe.szExeFile;
-            v.push_back(std::move(p));
-        } while (Process32NextW(snap, &pe));
-    }
-    CloseHandle(snap);
-
-    for (auto& p : v) {
-        if (p.pid == 0) continue; // Idle
-        HANDLE h = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, p.pid);
-        if (h) {
-            wchar_t buf[MAX_PATH * 4] = { 0 }; DWORD sz = (DWORD)(MAX_PATH * 4);
-            if (QueryFullProcessImageNameW(h, 0, buf, &sz)) p.path.assign(buf, sz);
-            PROCESS_MEMORY_COUNTERS_EX pmc{};
-            if (GetProcessMemoryInfo(h, (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc))) {
-                p.rss = pmc.WorkingSetSize;
-            }
-            CloseHandle(h);
-        }
-    }
-    return v;
-}
-
-// Build parent->children map
-static std::unordered_map<DWORD, std::vector<DWORD>> BuildChildren(const std::vector<Proc>& v) {
-    std::unordered_map<DWORD, std::vector<DWORD>> m;
-    for (auto& p : v) m[p.ppid].push_back(p.pid);
-    return m;
-}
-static void CollectTree(DWORD pid, const std::unordered_map<DWORD, std::vector<DWORD>>& ch, std::vector<DWORD>& out) {
-    out.push_back(pid);
-    auto it = ch.find(pid); if (it == ch.end()) return;
-    for (DWORD c : it->second) CollectTree(c, ch, out);
-}
-
-static bool TerminatePid(DWORD pid) {
-    HANDLE h = OpenProcess(PROCESS_TERMINATE, FALSE, pid);
-    if (!h) return false;
-    BOOL ok = TerminateProcess(h, 1);
-    CloseHandle(h);
-    return ok != 0;
-}
-static bool SuspendPid(DWORD pid) {
-    if (!pNtSuspendProcess) return false;
-    HANDLE h = OpenProcess(PROCESS_SUSPEND_RESUME | PROCESS_QUERY_INFORMATION, FALSE, pid);
-    if (!h) return false;
-    LONG st = pNtSuspendProcess(h);
-    CloseHandle(h);
-    return st == 0;
-}
-static bool ResumePid(DWORD pid) {
-    if (!pNtResumeProcess) return false;
-    HANDLE h = OpenProcess(PROCESS_SUSPEND_RESUME | PROCESS_QUERY_INFORMATION, FALSE, pid);
-    if (!h) return false;
-    LONG st = pNtResumeProcess(h);
-    CloseHandle(h);
-    return st == 0;
-}
+// -------------------- Private messages --------------------
+enum : UINT {
+    WM_APP_SNAPSHOT = WM_APP + 1,       // worker finished a snapshot; swap it in (see TakeSnapshot)
+    WM_APP_EXPORT_PROGRESS = WM_APP + 2, // wParam = percent done
+    WM_APP_EXPORT_DONE = WM_APP + 3,     // wParam = 0 or Win32 error (ERROR_CANCELLED if stopped)
+    WM_APP_ACTION_PROGRESS = WM_APP + 4, // wParam = victims handled, lParam = total
+    WM_APP_ACTION_DONE = WM_APP + 5,     // results are in g_action
+    WM_APP_PROCESS_EVENTS = WM_APP + 6,  // process events are queued (see TakeProcessEvents)
+    WM_APP_PATHS = WM_APP + 7            // lazy paths have been resolved (see TakePaths)
+};
 
 // -------------------- App state --------------------
+// List columns, in display order. PID (read back for the selection) and Name are
+// always shown; the rest can be toggled from the header's context menu.
+enum Column : int { ColPid, ColPpid, ColCpu, ColRss, ColPrivate, ColCommit, ColFaults, ColRead, ColWrite, ColName, ColPath, ColCount };
 struct AppState {
     HWND hwnd{}, hwndList{}, hLblSearch{}, hSearch{}, hChkTree{};
     HWND hBtnRefresh{}, hBtnKill{}, hBtnSuspend{}, hBtnResume{}, hBtnJson{}, hBtnCsv{}, hStatus{};
-    std::vector<Proc> all, filtered;
+    std::vector<Proc> all, incoming;
+    std::vector<uint32_t> order;    // every row, as indices into `all`, in display order
+    std::vector<uint32_t> filtered; // rows shown, a subsequence of `order`
     std::wstring filter;
+    std::wstring needle;   // filter, case-folded once per edit
+    // Narrowing filter: `filtered` matches `filteredNeedle`; each level below it
+    // holds a coarser match set whose needle is contained in the one above.
+    struct FilterLevel { std::wstring needle; std::vector<uint32_t> rows; };
+    std::wstring filteredNeedle;
+    std::vector<FilterLevel> filterStack;
+    StringFilter match;    // live rows against `needle`
+    SnapshotDiff diff;     // what the latest snapshot changed
+    bool anyFresh = false; // some row in g.all is highlighted as new
+    bool live = false;     // View > Live update
+    bool recording = false; // View > Record history
+    bool sharing = false;   // View > Share snapshots
+    bool stats = false;     // View > Show timings
+    bool tracking = false;  // View > Track starts/exits
+    bool eventsDue = false; // kEventTimer is set for a batch of process events
+    std::vector<ProcEvent> eventBatch;
+    std::unordered_map<ProcKey, uint32_t, ProcKeyHash> rowOf; // g.all index by process (see FindRow)
+    bool rowOfStale = true; // g.all was replaced or compacted since rowOf was built
+    unsigned collect = 0;   // Collect* flags the worker was last given (see CollectMask)
+    std::unordered_set<ProcKey, ProcKeyHash> pathsAsked; // lazy paths requested and not back yet
+    std::vector<PathResult> pathBatch;
+    uint64_t statsBase[CounterCount]{}, statsLast[CounterCount]{}; // counter totals at / counts since the last refresh
+    int64_t paintLast = 0;  // StagePaint ticks up to the last refresh
+    bool treeView = false;  // View > Process tree (live rows only)
+    ProcTree tree;          // over g.all, rebuilt with g.order
+    struct TreeLine { uint16_t depth; wchar_t mark; }; // mark: '+' collapsed, '-' expanded, ' ' leaf
+    std::vector<TreeLine> lines;                        // parallel to `filtered` in the tree view
+    std::unordered_map<ProcKey, bool, ProcKeyHash> expanded; // the user's choice; default by subtree size
+    bool minimized = false;
+    std::vector<int> columns;   // visible columns: subitem index -> Column
+    int columnWidth[ColCount]{}; // last width of each column (0 = default)
+    int sortColumn = ColRss;     // header click; kept across refreshes
+    // The selection, by process: survives refresh, re-sort and filtering. The control's
+    // LVIS_SELECTED bits mirror it for the rows shown (see SyncSelection).
+    std::unordered_set<ProcKey, ProcKeyHash> selected;
+    bool syncingSelection = false; // we are setting the control's bits; ignore its notifications
+    bool sortDescending = true;
+    // Owner-data cell cache (see LVN_ODCACHEHINT): formatted numbers for rows [cacheFrom, cacheFrom+cache.size())
+    struct RowCells { wchar_t text[ColName][24]; }; // numeric columns, indexed by Column
+    int cacheFrom = 0;
+    std::vector<RowCells> cache;
 } g;
 
-// -------------------- Output builders --------------------
-static std::wstring BuildJson(const std::vector<Proc>& v) {
-    std::wstringstream w;
-    w << L"{\"processes\":[";
-    for (size_t i = 0; i < v.size(); ++i) {
-        const auto& p = v[i];
-        w << L"{\"pid\":" << p.pid << L",\"ppid\":" << p.ppid
-            << L",\"name\":\"" << JsonEscape(p.name) << L"\","
-            << L"\"path\":\"" << JsonEscape(p.path) << L"\","
-            << L"\"rss_bytes\":" << p.rss << L"}"
-            << (i + 1 < v.size() ? L"," : L"");
-    }
-    w << L"]}\n";
-    return w.str();
-}
-static std::wstring BuildCsv(const std::vector<Proc>& v) {
-    std::wstringstream w; w << L"PID,PPID,RSS_BYTES,Name,Path\n";
-    for (auto& p : v) {
-        auto q = [&](const std::wstring& s) { return L"\"" + CsvEscape(s) + L"\""; };
-        w << p.pid << L"," << p.ppid << L"," << p.rss << L"," << q(p.name) << L"," << q(p.path) << L"\n";
-    }
-    return w.str();
-}
-
+// -------------------- File dialogs --------------------
 // Double-NUL filter must be an LPCWSTR literal (wstring would cut at first '\0')
-static bool SaveWithDialog(const std::wstring& title, const std::wstring& defExt, LPCWSTR filter, const std::wstring& content) {
+static bool AskSavePath(const std::wstring& title, const std::wstring& defExt, LPCWSTR filter, std::wstring& path) {
     wchar_t file[MAX_PATH] = L"";
     OPENFILENAMEW ofn{ 0 };
     ofn.lStructSize = sizeof(ofn);
@@ -272,96 +216,1385 @@ static bool SaveWithDialog(const std::wstring& title, const std::wstring& defExt
     ofn.lpstrTitle = title.c_str();
     ofn.Flags = OFN_OVERWRITEPROMPT;
     if (!GetSaveFileNameW(&ofn)) return false;
-    return SaveUtf8File(file, content, true);
+    path = file;
+    return true;
+}
+static bool AskOpenPath(const std::wstring& title, LPCWSTR filter, std::wstring& path) {
+    wchar_t file[MAX_PATH] = L"";
+    OPENFILENAMEW ofn{ 0 };
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = g.hwnd;
+    ofn.lpstrFilter = filter;
+    ofn.nFilterIndex = 1;
+    ofn.lpstrFile = file;
+    ofn.nMaxFile = MAX_PATH;
+    ofn.lpstrTitle = title.c_str();
+    ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST;
+    if (!GetOpenFileNameW(&ofn)) return false;
+    path = file;
+    return true;
+}
+
+// -------------------- Snapshot archive --------------------
+// The .pms file shown instead of the live rows (File > Open snapshot); UI thread only.
+static const wchar_t kPmsFilter[] = L"ProcMon snapshot (*.pms)\0*.pms\0All Files (*.*)\0*.*\0";
+static SnapshotArchive g_archive;
+static bool ArchiveOpen() { return g_archive.base != nullptr; }
+
+static void CloseArchive() {
+    if (g_archive.base) UnmapViewOfFile(g_archive.base);
+    g_archive = SnapshotArchive();
+}
+// Bounds of string `id` in STRDATA; false for IDs or offsets a damaged file gets wrong.
+static bool ArchiveSpan(uint32_t id, uint32_t& from, uint32_t& len) {
+    const SnapshotArchive& a = g_archive;
+    if (id >= a.hdr->strings) return false;
+    const uint32_t b = a.strOff[id], e = a.strOff[id + 1];
+    if (b >= e || e > a.strChars || a.strData[e - 1] != L'\0') return false;
+    from = b; len = e - b - 1;
+    return true;
+}
+static const wchar_t* ArchiveString(uint32_t id) {
+    uint32_t from, len;
+    return ArchiveSpan(id, from, len) ? g_archive.strData + from : L"";
+}
+static Proc ArchiveRow(uint32_t i) {
+    const SnapshotArchive& a = g_archive;
+    Proc p;
+    p.pid = a.pid[i]; p.ppid = a.ppid[i];
+    p.rss = (SIZE_T)a.rss[i]; p.created = a.created[i];
+    if (a.cpuTime) p.cpuTime = a.cpuTime[i];
+    if (a.privateBytes) p.privateBytes = (SIZE_T)a.privateBytes[i];
+    if (a.commit) p.commit = (SIZE_T)a.commit[i];
+    if (a.pageFaults) p.pageFaults = a.pageFaults[i];
+    if (a.readBytes) p.readBytes = a.readBytes[i];
+    if (a.writeBytes) p.writeBytes = a.writeBytes[i];
+    p.name = g_strings.Intern(ArchiveString(a.name[i])); p.path = g_strings.Intern(ArchiveString(a.path[i]));
+    return p;
+}
+// Archive filtering tests each distinct string at most once per needle, against a
+// folded copy of the string table made on the first keystroke.
+static void ArchiveFold() {
+    SnapshotArchive& a = g_archive;
+    if (!a.folded.empty()) return;
+    a.folded.assign(a.strData, a.strData + a.strChars);
+    for (wchar_t& c : a.folded) c = (wchar_t)towlower(c);
+}
+static void ArchivePrepareFilter(const std::wstring& needle) {
+    SnapshotArchive& a = g_archive;
+    ArchiveFold();
+    if (a.hit.empty() || a.hitNeedle != needle) { a.hit.assign(a.hdr->strings, -1); a.hitNeedle = needle; }
+}
+static bool ArchiveStringMatches(uint32_t id) {
+    SnapshotArchive& a = g_archive;
+    uint32_t from, len;
+    if (!ArchiveSpan(id, from, len)) return false;
+    signed char& h = a.hit[id];
+    if (h < 0) h = ContainsFolded(a.folded.data() + from, len, a.hitNeedle.data(), a.hitNeedle.size()) ? 1 : 0;
+    return h != 0;
+}
+static bool ArchiveRowMatches(uint32_t i) {
+    return ArchiveStringMatches(g_archive.name[i]) || ArchiveStringMatches(g_archive.path[i]);
+}
+
+// -------------------- Live mode pacing --------------------
+// A live rescan may use at most kLiveCpuBudget of one core: the next interval is
+// the scan's CPU time divided by the budget, never below kLiveBaseMs (kLiveTrackedMs
+// while process events report starts and exits, so scans only reconcile). While the
+// window can't be seen the interval is stretched by kLiveHiddenFactor. The scan's CPU
+// time is the whole process's: Snapshot fans out to ParallelFor's pool threads, which
+// a per-thread count would miss (it also charges whatever the UI did meanwhile).
+static const double kLiveCpuBudget = 0.05;
+static const DWORD kLiveBaseMs = 2000, kLiveTrackedMs = 10000, kLiveMaxMs = 60000, kLiveHiddenFactor = 4;
+
+static ULONGLONG ProcessCpuTime() { // kernel + user of all threads, 100ns ticks
+    FILETIME c{}, x{}, k{}, u{};
+    if (!GetProcessTimes(GetCurrentProcess(), &c, &x, &k, &u)) return 0;
+    return (((ULONGLONG)k.dwHighDateTime << 32) | k.dwLowDateTime) + (((ULONGLONG)u.dwHighDateTime << 32) | u.dwLowDateTime);
+}
+// Minimized, hidden, or fully covered by other windows.
+static bool WindowObscured(HWND h) {
+    if (!h || IsIconic(h) || !IsWindowVisible(h)) return true;
+    HDC dc = GetDC(h);
+    if (!dc) return false;
+    RECT rc{};
+    const int kind = GetClipBox(dc, &rc);
+    ReleaseDC(h, dc);
+    return kind == NULLREGION;
+}
+static DWORD LiveInterval(ULONGLONG scanCpu, bool obscured, bool tracked) {
+    double ms = (double)scanCpu / 10000.0 / kLiveCpuBudget;
+    DWORD iv = (DWORD)std::min<double>(std::max<double>(ms, tracked ? kLiveTrackedMs : kLiveBaseMs), kLiveMaxMs);
+    if (obscured) iv = std::min(iv * kLiveHiddenFactor, kLiveMaxMs);
+    return iv;
+}
+
+// -------------------- Background snapshot worker --------------------
+// The worker fills a back buffer and parks it in `ready`; the UI swaps it with
+// g.all on WM_APP_SNAPSHOT and hands the old front buffer back for reuse.
+// Requests arriving while a scan is in flight coalesce into one follow-up scan.
+// In live mode a timed-out wait counts as a request.
+struct SnapshotWorker {
+    std::thread thread;
+    std::mutex mu;
+    std::condition_variable cv;
+    bool requested = false, stop = false, posted = false;
+    bool live = false;
+    bool share = false;             // publish to g_shared (see Shared snapshot)
+    bool tracked = false;           // process events are on (see LiveInterval)
+    unsigned collect = 0;           // Collect* flags for the visible columns
+    DWORD intervalMs = kLiveBaseMs; // next live interval (worker-computed)
+    std::vector<Proc> ready;   // completed snapshot waiting for the UI (guarded by mu)
+    SnapshotDiff readyDiff;    // its diff against the previous snapshot (guarded by mu)
+    ULONGLONG readyAt = 0;     // FILETIME its scan began (guarded by mu)
+    std::vector<Proc> spare;   // recycled front buffer (guarded by mu)
+    HWND notify{};
+};
+static SnapshotWorker g_worker;
+
+static void SnapshotWorkerMain() {
+    std::vector<Proc> back;
+    SnapshotDiff diff;
+    SampleByKey prev, scratch;
+    const double cores = std::max<DWORD>(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS), 1);
+    std::chrono::steady_clock::time_point lastScan;
+    std::unique_lock<std::mutex> lk(g_worker.mu);
+    auto pending = [] { return g_worker.stop || g_worker.requested; };
+    for (;;) {
+        if (!g_worker.live) g_worker.cv.wait(lk, pending);
+        else if (!g_worker.cv.wait_for(lk, std::chrono::milliseconds(g_worker.intervalMs), pending) && g_worker.live)
+            g_worker.requested = true; // live tick
+        if (g_worker.stop) return;
+        if (!g_worker.requested) continue;
+        g_worker.requested = false;
+        const unsigned collect = g_worker.collect;
+        const bool share = g_worker.share, tracked = g_worker.tracked;
+        back.swap(g_worker.spare);
+        lk.unlock();
+
+        const ULONGLONG cpu0 = ProcessCpuTime(), scanFt = NowFileTime();
+        const auto scanAt = std::chrono::steady_clock::now();
+        {
+            StageTimer timer(StageScan);
+            Snapshot(back, collect);
+        }
+        const double secs = std::chrono::duration<double>(scanAt - lastScan).count();
+        lastScan = scanAt;
+        {
+            StageTimer timer(StageDiff);
+            DiffSnapshots(prev, scratch, back, diff, prev.empty() ? 0.0 : secs, cores);
+        }
+        RecordHistory(back, diff);
+        if (share) PublishSnapshot(back);
+        const DWORD iv = LiveInterval(ProcessCpuTime() - cpu0, WindowObscured(g_worker.notify), tracked);
+
+        lk.lock();
+        g_worker.intervalMs = iv;
+        back.swap(g_worker.ready); // an unconsumed older result is simply superseded
+        g_worker.readyAt = scanFt;
+        diff.superseded = g_worker.posted;
+        diff.added.swap(g_worker.readyDiff.added);
+        diff.changed.swap(g_worker.readyDiff.changed);
+        diff.removed.swap(g_worker.readyDiff.removed);
+        g_worker.readyDiff.superseded = diff.superseded;
+        if (!g_worker.posted && g_worker.notify) {
+            g_worker.posted = true;
+            PostMessageW(g_worker.notify, WM_APP_SNAPSHOT, 0, 0);
+        }
+    }
+}
+static void StartSnapshotWorker(HWND notify) {
+    g_worker.notify = notify;
+    g_worker.thread = std::thread(SnapshotWorkerMain);
+}
+static void StopSnapshotWorker() {
+    {
+        std::lock_guard<std::mutex> lk(g_worker.mu);
+        g_worker.stop = true;
+    }
+    g_worker.cv.notify_one();
+    if (g_worker.thread.joinable()) g_worker.thread.join();
+}
+static void SetLiveMode(bool on) {
+    {
+        std::lock_guard<std::mutex> lk(g_worker.mu);
+        g_worker.live = on;
+        if (on) g_worker.requested = true; // start with a fresh scan
+    }
+    g_worker.cv.notify_one();
+}
+// Ask for a rescan; a no-op if one is already queued.
+static void RequestSnapshot() {
+    {
+        std::lock_guard<std::mutex> lk(g_worker.mu);
+        g_worker.requested = true;
+    }
+    g_worker.cv.notify_one();
+}
+static void SetSharing(bool on) {
+    {
+        std::lock_guard<std::mutex> lk(g_worker.mu);
+        g_worker.share = on;
+    }
+    if (on) RequestSnapshot(); // publish now, not at the next live tick
+}
+static void SetTracking(bool on) {
+    {
+        std::lock_guard<std::mutex> lk(g_worker.mu);
+        g_worker.tracked = on;
+    }
+    if (on) RequestSnapshot(); // reconcile with the events from now on
+}
+// Counters the next scans must collect (a column was shown or hidden).
+static void SetCollectMask(unsigned collect) {
+    {
+        std::lock_guard<std::mutex> lk(g_worker.mu);
+        g_worker.collect = collect;
+    }
+    RequestSnapshot();
+}
+// UI thread: move the finished snapshot (its diff, when its scan began) into `incoming`.
+// Returns false if nothing was pending.
+static bool TakeSnapshot(std::vector<Proc>& incoming, SnapshotDiff& diff, ULONGLONG& scanAt) {
+    std::lock_guard<std::mutex> lk(g_worker.mu);
+    if (!g_worker.posted) return false;
+    g_worker.posted = false;
+    incoming.swap(g_worker.ready);
+    std::swap(diff, g_worker.readyDiff);
+    scanAt = g_worker.readyAt;
+    return true;
+}
+// UI thread: hand a no longer displayed buffer back as the worker's next back buffer.
+static void RecycleSnapshot(std::vector<Proc>& old) {
+    std::lock_guard<std::mutex> lk(g_worker.mu);
+    g_worker.spare.swap(old);
 }
 
 // -------------------- ListView helpers --------------------
+struct ColumnDef {
+    const wchar_t* title;
+    int width;
+    bool shown, fixed; // shown by default / can't be hidden
+    unsigned collect;  // Collect* flags its values need
+};
+static const ColumnDef kColumns[ColCount] = {
+    { L"PID", 80, true, true, 0 },
+    { L"PPID", 80, true, false, 0 },
+    { L"CPU %", 60, true, false, 0 },
+    { L"RSS", 110, true, false, 0 },
+    { L"Private", 100, false, false, 0 },
+    { L"Commit", 100, false, false, 0 },
+    { L"Faults/s", 80, false, false, 0 },
+    { L"Read/s", 100, false, false, CollectIo },
+    { L"Write/s", 100, false, false, CollectIo },
+    { L"Name", 220, true, true, 0 },
+    { L"Path", 700, true, false, 0 },
+};
+static bool ColumnShown(int c) { return std::find(g.columns.begin(), g.columns.end(), c) != g.columns.end(); }
+// What scans must collect: the counters of the visible columns (all of them while
+// recording history), and every image path while something needs all of them (a
+// filter, sorting by path, history, sharing).
+// Otherwise only rows scrolled into view get their paths (see RequestVisiblePaths).
+static unsigned CollectMask() {
+    unsigned m = 0;
+    for (int c : g.columns) m |= kColumns[c].collect;
+    if (g.recording) m |= CollectIo; // history keeps every counter
+    if (!g.needle.empty() || g.sortColumn == ColPath || g.recording || g.sharing) m |= CollectPaths;
+    return m;
+}
+// Tell the worker if the mask changed (it rescans then). When paths become needed
+// the rows on hand get theirs now, as for an export, so the filter or path sort the
+// caller applies next doesn't run on empty ones until the rescan lands.
+static void UpdateCollectMask() {
+    const unsigned m = CollectMask();
+    if (m == g.collect) return;
+    if ((m & CollectPaths) && !(g.collect & CollectPaths)) {
+        LoadPaths(g.all);
+        if (!ArchiveOpen()) InvalidateRect(g.hwndList, nullptr, FALSE);
+    }
+    g.collect = m;
+    SetCollectMask(m);
+}
+// Arrow on the header of the sort column (if it is visible).
+static void ListView_ShowSortArrow(HWND lv) {
+    HWND header = ListView_GetHeader(lv);
+    for (int i = 0; i < (int)g.columns.size(); ++i) {
+        HDITEMW hd{}; hd.mask = HDI_FORMAT;
+        if (!Header_GetItem(header, i, &hd)) continue;
+        hd.fmt &= ~(HDF_SORTUP | HDF_SORTDOWN);
+        if (g.columns[(size_t)i] == g.sortColumn) hd.fmt |= g.sortDescending ? HDF_SORTDOWN : HDF_SORTUP;
+        Header_SetItem(header, i, &hd);
+    }
+}
+// (Re)create the header from g.columns, keeping widths the user dragged.
 static void ListView_SetupColumns(HWND lv) {
+    if (g.columns.empty()) {
+        for (int c = 0; c < ColCount; ++c) if (kColumns[c].shown) g.columns.push_back(c);
+    }
+    // Column 0 is always PID; it is created once and never deleted.
+    HWND header = ListView_GetHeader(lv);
+    int have = header ? Header_GetItemCount(header) : 0;
+    while (have > 1) ListView_DeleteColumn(lv, --have);
     LVCOLUMNW col{ 0 }; col.mask = LVCF_TEXT | LVCF_WIDTH | LVCF_SUBITEM;
-    // 5 columns: PID, PPID, RSS, Name, Path
-    int w[] = { 80,80,110,220,700 };
-    const wchar_t* t[] = { L"PID",L"PPID",L"RSS",L"Name",L"Path" };
-    for (int i = 0; i < 5; ++i) {
-        col.pszText = (LPWSTR)t[i]; col.cx = w[i]; col.iSubItem = i;
+    for (int i = have; i < (int)g.columns.size(); ++i) {
+        const int c = g.columns[(size_t)i];
+        col.pszText = (LPWSTR)kColumns[c].title;
+        col.cx = g.columnWidth[c] ? g.columnWidth[c] : kColumns[c].width;
+        col.iSubItem = i;
         ListView_InsertColumn(lv, i, &col);
     }
+    ListView_ShowSortArrow(lv);
+}
+static void ListView_ToggleColumn(HWND lv, int c) {
+    if (c < 0 || c >= ColCount || kColumns[c].fixed) return;
+    for (int i = 0; i < (int)g.columns.size(); ++i) g.columnWidth[g.columns[(size_t)i]] = ListView_GetColumnWidth(lv, i);
+    auto it = std::find(g.columns.begin(), g.columns.end(), c);
+    if (it != g.columns.end()) g.columns.erase(it);
+    else g.columns.insert(std::upper_bound(g.columns.begin(), g.columns.end(), c), c);
+    ListView_SetupColumns(lv);
+    g.cache.clear();
+    InvalidateRect(lv, nullptr, FALSE);
+    g.collect = CollectMask();
+    SetCollectMask(g.collect); // also rescans, so a new column fills in
+}
+// Header right-click: one checkable entry per column.
+static void ListView_ColumnMenu(HWND lv, int x, int y) {
+    if (x == -1 && y == -1) { POINT pt{}; GetCursorPos(&pt); x = pt.x; y = pt.y; } // keyboard
+    HMENU m = CreatePopupMenu();
+    for (int c = 0; c < ColCount; ++c) {
+        const UINT flags = MF_STRING | (ColumnShown(c) ? MF_CHECKED : 0) | (kColumns[c].fixed ? MF_GRAYED : 0);
+        AppendMenuW(m, flags, IDM_COLUMN_FIRST + c, kColumns[c].title);
+    }
+    const int cmd = (int)TrackPopupMenu(m, TPM_RETURNCMD | TPM_RIGHTBUTTON, x, y, 0, g.hwnd, nullptr);
+    DestroyMenu(m);
+    if (cmd) ListView_ToggleColumn(lv, cmd - IDM_COLUMN_FIRST);
+}
+static const Proc& RowAt(int row) { return g.all[g.filtered[(size_t)row]]; } // live view only
+// Format the visible numeric columns. Archived rows (!live) only carry PID, PPID and RSS.
+static void FormatCells(const Proc& p, bool live, AppState::RowCells& c) {
+    auto size = [](wchar_t* out, size_t n, double b, const wchar_t* suffix) {
+        wcsncpy_s(out, n, (HumanSize((SIZE_T)b) + suffix).c_str(), _TRUNCATE);
+    };
+    for (int col : g.columns) {
+        if (col >= ColName) continue;
+        wchar_t* t = c.text[col];
+        const size_t n = ARRAYSIZE(c.text[col]);
+        if (!live && col != ColPid && col != ColPpid && col != ColRss) { t[0] = L'\0'; continue; }
+        switch (col) {
+        case ColPid: _itow_s((int)p.pid, t, n, 10); break;
+        case ColPpid: _itow_s((int)p.ppid, t, n, 10); break;
+        case ColCpu: { const int d = CpuTenths(p.cpu); swprintf_s(t, n, L"%d.%d", d / 10, d % 10); break; }
+        case ColRss: size(t, n, (double)p.rss, L""); break;
+        case ColPrivate: size(t, n, (double)p.privateBytes, L""); break;
+        case ColCommit: size(t, n, (double)p.commit, L""); break;
+        case ColFaults: swprintf_s(t, n, L"%.0f", p.faultRate); break;
+        case ColRead: size(t, n, p.readRate, L"/s"); break;
+        case ColWrite: size(t, n, p.writeRate, L"/s"); break;
+        }
+    }
+}
+// Row `row` of the list, from g.all or from the open archive.
+static bool TreeShown() { return g.treeView && !ArchiveOpen(); }
+static bool RowCollapsed(int row) { return TreeShown() && (size_t)row < g.lines.size() && g.lines[(size_t)row].mark == L'+'; }
+// A collapsed node shows the RSS and CPU % of its whole subtree.
+static void FormatRow(int row, AppState::RowCells& c) {
+    if (RowCollapsed(row)) {
+        const uint32_t i = g.filtered[(size_t)row];
+        Proc p = g.all[i];
+        p.rss = g.tree.subRss[i]; p.cpu = g.tree.subCpu[i];
+        FormatCells(p, true, c);
+        return;
+    }
+    if (!ArchiveOpen()) { FormatCells(RowAt(row), true, c); return; }
+    const uint32_t i = g.filtered[(size_t)row];
+    Proc p;
+    p.pid = g_archive.pid[i]; p.ppid = g_archive.ppid[i]; p.rss = (SIZE_T)g_archive.rss[i];
+    FormatCells(p, false, c);
+}
+static const wchar_t* RowString(int row, bool path) {
+    if (ArchiveOpen()) {
+        const uint32_t i = g.filtered[(size_t)row];
+        return ArchiveString(path ? g_archive.path[i] : g_archive.name[i]);
+    }
+    const Proc& p = RowAt(row);
+    return g_strings.CStr(path ? p.path : p.name);
+}
+// Lazy paths (see RequestPaths) for rows [from, to] on screen, if the Path column is.
+static void NotifyPaths(void* hwnd) { PostMessageW((HWND)hwnd, WM_APP_PATHS, 0, 0); } // pool thread
+static void RequestVisiblePaths(int from, int to) {
+    if (ArchiveOpen() || !ColumnShown(ColPath)) return;
+    std::vector<ProcKey> keys;
+    for (int i = from; i <= to; ++i) {
+        const Proc& p = RowAt(i);
+        if (p.lazyPath && g.pathsAsked.insert(KeyOf(p)).second) keys.push_back(KeyOf(p));
+    }
+    RequestPaths(keys, NotifyPaths, g.hwnd);
+}
+// WM_APP_PATHS: write the resolved paths into their rows (by key: g.all may be newer).
+static void OnPathsLoaded() {
+    TakePaths(g.pathBatch);
+    if (g.pathBatch.empty()) return;
+    std::unordered_map<ProcKey, uint32_t, ProcKeyHash> got;
+    for (const PathResult& r : g.pathBatch) { got.emplace(r.key, r.path); g.pathsAsked.erase(r.key); }
+    for (Proc& p : g.all) {
+        if (!p.lazyPath) continue;
+        auto it = got.find(KeyOf(p));
+        if (it != got.end()) { p.path = it->second; p.lazyPath = false; }
+    }
+    if (!ArchiveOpen()) InvalidateRect(g.hwndList, nullptr, FALSE);
+}
+// LVN_ODCACHEHINT: pre-format the range the control is about to paint.
+static void ListView_CacheHint(int from, int to) {
+    StageTimer timer(StagePaint, true);
+    const int n = (int)g.filtered.size();
+    from = std::max(from, 0); to = std::min(to, n - 1);
+    if (from > to) return;
+    RequestVisiblePaths(from, to); // before the early out: a new snapshot may have lazy rows in the same range
+    if (from >= g.cacheFrom && to < g.cacheFrom + (int)g.cache.size()) return;
+    g.cacheFrom = from;
+    g.cache.resize((size_t)(to - from + 1));
+    for (int i = from; i <= to; ++i) FormatRow(i, g.cache[(size_t)(i - from)]);
+}
+static const AppState::RowCells& ListView_CellsFor(int row) {
+    if (row >= g.cacheFrom && row < g.cacheFrom + (int)g.cache.size()) return g.cache[(size_t)(row - g.cacheFrom)];
+    static AppState::RowCells scratch; // outside the hinted range (e.g. GetItemText of a selected row)
+    FormatRow(row, scratch);
+    return scratch;
+}
+// LVN_GETDISPINFO: the returned pointers stay valid until g.filtered/g.cache change.
+static void ListView_GetDispInfo(NMLVDISPINFOW* di) {
+    StageTimer timer(StagePaint, true);
+    LVITEMW& it = di->item;
+    if (!(it.mask & LVIF_TEXT) || it.iItem < 0 || it.iItem >= (int)g.filtered.size()) return;
+    if (it.iSubItem < 0 || it.iSubItem >= (int)g.columns.size()) return;
+    const int col = g.columns[(size_t)it.iSubItem];
+    if (col == ColName && TreeShown() && it.pszText && it.cchTextMax > 0 && (size_t)it.iItem < g.lines.size()) {
+        // "   [+] msbuild.exe (1240)": indented by depth, with the size of a collapsed subtree
+        const AppState::TreeLine& t = g.lines[(size_t)it.iItem];
+        const int indent = 3 * std::min<int>(t.depth, 32);
+        const wchar_t* mark = t.mark == L'+' ? L"[+] " : t.mark == L'-' ? L"[-] " : L"    ";
+        const uint32_t i = g.filtered[(size_t)it.iItem];
+        if (t.mark == L'+') _snwprintf_s(it.pszText, (size_t)it.cchTextMax, _TRUNCATE, L"%*s%s%s (%u)", indent, L"", mark, RowString(it.iItem, false), g.tree.subCount[i] - 1);
+        else _snwprintf_s(it.pszText, (size_t)it.cchTextMax, _TRUNCATE, L"%*s%s%s", indent, L"", mark, RowString(it.iItem, false));
+        return;
+    }
+    if (col == ColName || col == ColPath) it.pszText = (LPWSTR)RowString(it.iItem, col == ColPath);
+    else it.pszText = (LPWSTR)ListView_CellsFor(it.iItem).text[col];
+}
+// NM_CUSTOMDRAW: tint processes that appeared since the previous snapshot and gray
+// out the ones that exited (kept for their grace period).
+static LRESULT ListView_CustomDraw(NMLVCUSTOMDRAW* cd) {
+    switch (cd->nmcd.dwDrawStage) {
+    case CDDS_PREPAINT:
+        return CDRF_NOTIFYITEMDRAW;
+    case CDDS_ITEMPREPAINT:
+        if (!ArchiveOpen() && cd->nmcd.dwItemSpec < g.filtered.size()) {
+            const Proc& p = RowAt((int)cd->nmcd.dwItemSpec);
+            if (p.fresh) cd->clrTextBk = RGB(220, 245, 220);
+            if (p.exited) cd->clrText = GetSysColor(COLOR_GRAYTEXT);
+        }
+        return CDRF_DODEFAULT;
+    }
+    return CDRF_DODEFAULT;
+}
+// Publish g.filtered to the owner-data list: only the row count is handed over.
+static void ListView_ShowFiltered(HWND lv) {
+    g.cache.clear();
+    ListView_SetItemCountEx(lv, (int)g.filtered.size(), LVSICF_NOSCROLL);
+    InvalidateRect(lv, nullptr, FALSE);
 }
-static void ListView_Clear(HWND lv) { ListView_DeleteAllItems(lv); }
-static void ListView_AddOrSet(HWND lv, int row, const Proc& p) {
-    wchar_t buf[64] = { 0 };
-    LVITEMW it{ 0 }; it.mask = LVIF_TEXT; it.iItem = row;
 
-    // Column 0: PID
-    _itow_s((int)p.pid, buf, 10); it.pszText = buf;
-    if (ListView_GetItemCount(lv) <= row) ListView_InsertItem(lv, &it);
-    else ListView_SetItem(lv, &it);
+// -------------------- Filtering & Refresh --------------------
+static const size_t kMaxFilterLevels = 32;
+// Rows the list can show: the open archive's, else g.all's.
+static size_t RowCount() { return ArchiveOpen() ? g_archive.hdr->rows : g.all.size(); }
+// SortRows' key for a live row on a numeric column.
+static uint64_t NumericKey(const Proc& p, int c) {
+    auto rate = [](float f) { return f > 0 ? (uint64_t)(f * 1024.0) : 0ull; };
+    switch (c) {
+    case ColPid: return p.pid;
+    case ColPpid: return p.ppid;
+    case ColCpu: return rate(p.cpu);
+    case ColRss: return p.rss;
+    case ColPrivate: return p.privateBytes;
+    case ColCommit: return p.commit;
+    case ColFaults: return rate(p.faultRate);
+    case ColRead: return rate(p.readRate);
+    case ColWrite: return rate(p.writeRate);
+    }
+    return 0;
+}
+// Rebuild g.order for g.sortColumn. Rows are never moved: each gets one integer key
+// (a number, or its name/path's rank among the case-folded strings) and only the
+// index permutation is sorted. Ties keep snapshot order, so equal rows don't jitter.
+static void SortRows() {
+    StageTimer timer(StageSort);
+    const size_t n = RowCount();
+    const bool archive = ArchiveOpen();
+    const int c = g.sortColumn;
+    std::vector<uint64_t> key(n);
+    if (c == ColName || c == ColPath) {
+        // Rank each distinct string once (folded compare); rows share their string's rank.
+        std::vector<uint32_t> col(n), ids;
+        auto rank = [&](auto text, uint32_t top) {
+            std::vector<uint32_t> r((size_t)top + 1, UINT32_MAX);
+            for (uint32_t id : col) if (r[id] == UINT32_MAX) { r[id] = 0; ids.push_back(id); }
+            std::sort(ids.begin(), ids.end(), [&](uint32_t x, uint32_t y) { return text(x) < text(y); });
+            for (size_t k = 0; k < ids.size(); ++k)
+                r[ids[k]] = (k && text(ids[k]) == text(ids[k - 1])) ? r[ids[k - 1]] : (uint32_t)k;
+            for (size_t i = 0; i < n; ++i) key[i] = r[col[i]];
+        };
+        if (archive) {
+            SnapshotArchive& a = g_archive;
+            ArchiveFold();
+            const uint32_t* src = c == ColName ? a.name : a.path;
+            const uint32_t bad = a.hdr->strings; // out-of-range IDs sort as ""
+            for (size_t i = 0; i < n; ++i) col[i] = src[i] < bad ? src[i] : bad;
+            rank([&](uint32_t id) {
+                uint32_t from = 0, len = 0;
+                if (!ArchiveSpan(id, from, len)) return std::wstring_view();
+                return std::wstring_view(a.folded.data() + from, len);
+            }, bad);
+        }
+        else {
+            uint32_t top = 0;
+            for (size_t i = 0; i < n; ++i) { col[i] = c == ColName ? g.all[i].name : g.all[i].path; top = std::max(top, col[i]); }
+            rank([](uint32_t id) { return g_strings.Folded(id); }, top);
+        }
+    }
+    else if (archive) {
+        const SnapshotArchive& a = g_archive;
+        for (size_t i = 0; i < n; ++i)
+            key[i] = c == ColPid ? a.pid[i] : c == ColPpid ? a.ppid[i] : c == ColRss ? a.rss[i] : 0;
+    }
+    else {
+        for (size_t i = 0; i < n; ++i) key[i] = NumericKey(g.all[i], c);
+    }
+    g.order.resize(n);
+    for (uint32_t i = 0; i < (uint32_t)n; ++i) g.order[i] = i;
+    const bool desc = g.sortDescending;
+    std::sort(g.order.begin(), g.order.end(), [&](uint32_t x, uint32_t y) {
+        if (key[x] != key[y]) return desc ? key[x] > key[y] : key[x] < key[y];
+        return x < y;
+        });
+    if (TreeShown()) {
+        BuildProcTree(g.all, g.order, g.tree);
+        if (g.expanded.size() > 2 * n + 64) { // forget processes that exited
+            std::unordered_map<ProcKey, bool, ProcKeyHash> keep;
+            for (const Proc& p : g.all) { auto it = g.expanded.find(KeyOf(p)); if (it != g.expanded.end()) keep.insert(*it); }
+            g.expanded.swap(keep);
+        }
+    }
+}
+// Start over from "every row" (after a new snapshot or a change of row source).
+static void ResetFilter() {
+    g.filterStack.clear();
+    g.filteredNeedle.clear();
+    if (g.order.size() != RowCount()) SortRows();
+    g.filtered = g.order;
+}
+// Live filtering tests each distinct string at most once per needle, like the archive.
+static bool RowMatches(uint32_t i) {
+    g.match.SetNeedle(g.needle);
+    return g.match.Matches(g.all[i]);
+}
 
-    // Subitems
-    _itow_s((int)p.ppid, buf, 10); ListView_SetItemText(lv, row, 1, buf);
-    std::wstring rss = HumanSize(p.rss); ListView_SetItemText(lv, row, 2, (LPWSTR)rss.c_str());
-    ListView_SetItemText(lv, row, 3, (LPWSTR)p.name.c_str());
-    ListView_SetItemText(lv, row, 4, (LPWSTR)p.path.c_str());
+// Tree view rows: a depth-first walk that only descends into expanded nodes, so a
+// collapsed subtree costs nothing however large. Subtrees over kAutoCollapse
+// processes start collapsed. While filtering, matches are shown with all their
+// ancestors, fully expanded.
+static const uint32_t kAutoCollapse = 64;
+static bool TreeExpanded(uint32_t r) {
+    auto it = g.expanded.find(KeyOf(g.all[r]));
+    return it != g.expanded.end() ? it->second : g.tree.subCount[r] <= kAutoCollapse + 1;
+}
+static void BuildTreeRows() {
+    const ProcTree& t = g.tree;
+    const bool filtering = !g.needle.empty();
+    std::vector<char> keep;
+    if (filtering) {
+        keep.assign(g.all.size(), 0);
+        for (size_t k = t.preorder.size(); k-- > 0;) {
+            const uint32_t r = t.preorder[k];
+            if (!keep[r]) keep[r] = RowMatches(r);
+            if (keep[r] && t.parent[r] >= 0) keep[(size_t)t.parent[r]] = 1;
+        }
+    }
+    g.filtered.clear(); g.lines.clear();
+    std::vector<std::pair<uint32_t, uint16_t>> stack;
+    for (size_t k = t.roots.size(); k-- > 0;) if (!filtering || keep[t.roots[k]]) stack.emplace_back(t.roots[k], 0);
+    while (!stack.empty()) {
+        const uint32_t r = stack.back().first;
+        const uint16_t depth = stack.back().second;
+        stack.pop_back();
+        bool kids = false;
+        for (uint32_t k = t.childAt[r]; k < t.childAt[r + 1] && !kids; ++k) kids = !filtering || keep[t.children[k]];
+        const bool open = kids && (filtering || TreeExpanded(r));
+        g.filtered.push_back(r);
+        g.lines.push_back(AppState::TreeLine{ depth, !kids ? L' ' : open ? L'-' : L'+' });
+        if (!open) continue;
+        for (uint32_t k = t.childAt[r + 1]; k > t.childAt[r]; --k) {
+            const uint32_t c = t.children[k - 1];
+            if (!filtering || keep[c]) stack.emplace_back(c, (uint16_t)std::min<int>(depth + 1, 0xFFFF));
+        }
+    }
 }
 
-// -------------------- Filtering & Refresh --------------------
+// Bring g.filtered in line with g.needle. Every row matching the new needle also
+// matches any needle it contains, so we only ever scan the current match set.
 static void ApplyFilter() {
-    g.filtered.clear();
-    if (g.filter.empty()) { g.filtered = g.all; return; }
-    for (auto& p : g.all) {
-        if (IContains(p.name, g.filter) || IContains(p.path, g.filter)) g.filtered.push_back(p);
+    StageTimer timer(StageFilter);
+    if (TreeShown()) { // rebuilt as a whole; narrowing doesn't apply to a tree
+        g.filterStack.clear();
+        g.filteredNeedle = g.needle;
+        BuildTreeRows();
+        return;
     }
+    auto contains = [](const std::wstring& hay, const std::wstring& part) { return ContainsFolded(hay, part); };
+    // Pop back (Backspace, edits) until the current level is one the new needle extends.
+    while (!contains(g.needle, g.filteredNeedle)) {
+        if (g.filterStack.empty()) { ResetFilter(); break; }
+        g.filtered.swap(g.filterStack.back().rows);
+        g.filteredNeedle.swap(g.filterStack.back().needle);
+        g.filterStack.pop_back();
+    }
+    if (g.filteredNeedle == g.needle) return;
+
+    std::vector<uint32_t> narrowed;
+    narrowed.reserve(g.filtered.size());
+    if (ArchiveOpen()) {
+        ArchivePrepareFilter(g.needle);
+        for (uint32_t i : g.filtered) {
+            if (ArchiveRowMatches(i)) narrowed.push_back(i);
+        }
+    }
+    else {
+        g.match.SetNeedle(g.needle);
+        g.match.Narrow(g.all, g.filtered, narrowed);
+    }
+    if (g.filterStack.size() >= kMaxFilterLevels) g.filterStack.erase(g.filterStack.begin() + 1);
+    g.filterStack.push_back(AppState::FilterLevel{ std::move(g.filteredNeedle), std::move(g.filtered) });
+    g.filteredNeedle = g.needle;
+    g.filtered.swap(narrowed);
 }
+// Copies of the visible rows (exports).
+static std::vector<Proc> FilteredRows() {
+    std::vector<Proc> v; v.reserve(g.filtered.size());
+    for (uint32_t i : g.filtered) v.push_back(ArchiveOpen() ? ArchiveRow(i) : g.all[i]);
+    return v;
+}
+// Queue a background rescan; the list updates when WM_APP_SNAPSHOT arrives.
 static void RefreshData() {
-    g.all = Snapshot();
-    std::sort(g.all.begin(), g.all.end(), [](const Proc& a, const Proc& b) {
-        if (a.rss != b.rss) return a.rss > b.rss;
-        return a.name < b.name;
-        });
+    RequestSnapshot();
+}
+static ProcKey RowKey(int row) {
+    if (!ArchiveOpen()) return KeyOf(RowAt(row));
+    const uint32_t i = g.filtered[(size_t)row];
+    return ProcKey{ g_archive.pid[i], g_archive.created[i] };
+}
+// Set the control's selection bits from g.selected for the rows now shown.
+static void SyncSelection(HWND lv) {
+    g.syncingSelection = true;
+    for (int i = -1; (i = ListView_GetNextItem(lv, i, LVNI_SELECTED)) != -1;)
+        if (!g.selected.count(RowKey(i))) ListView_SetItemState(lv, i, 0, LVIS_SELECTED);
+    if (!g.selected.empty()) {
+        for (int i = 0; i < (int)g.filtered.size(); ++i)
+            if (g.selected.count(RowKey(i)) && !ListView_GetItemState(lv, i, LVIS_SELECTED)) ListView_SetItemState(lv, i, LVIS_SELECTED, LVIS_SELECTED);
+    }
+    g.syncingSelection = false;
+}
+// LVN_ITEMCHANGED / LVN_ODSTATECHANGED: the user changed the selection of rows
+// [from, to]; from < 0 means every row.
+static void OnSelectionChanged(int from, int to, bool selected) {
+    if (g.syncingSelection) return;
+    if (from < 0) {
+        if (!selected) { g.selected.clear(); return; }
+        from = 0; to = (int)g.filtered.size() - 1;
+    }
+    to = std::min(to, (int)g.filtered.size() - 1);
+    for (int i = std::max(from, 0); i <= to; ++i) {
+        if (selected) g.selected.insert(RowKey(i));
+        else g.selected.erase(RowKey(i));
+    }
+}
+// Selected processes that are shown, as rows of g.all (live view only).
+static std::vector<uint32_t> SelectedRows() {
+    std::vector<uint32_t> rows;
+    if (g.selected.empty() || ArchiveOpen()) return rows;
+    for (uint32_t i : g.filtered) if (g.selected.count(KeyOf(g.all[i]))) rows.push_back(i);
+    return rows;
+}
+// Swap in a new snapshot, re-filter, and touch only rows whose content moved.
+// Selection follows its processes by key; LVSICF_NOSCROLL keeps the scroll position.
+static void UpdateFilteredView(HWND lv, std::vector<Proc>& next) {
+    struct RowSig {
+        ProcKey key; SIZE_T rss, priv, commit; int cpu; float faults, rd, wr; bool fresh, exited; uint32_t path;
+        uint32_t line, count; // tree view: depth/mark and subtree size
+        bool operator==(const RowSig& o) const {
+            return key == o.key && rss == o.rss && priv == o.priv && commit == o.commit && cpu == o.cpu &&
+                faults == o.faults && rd == o.rd && wr == o.wr && fresh == o.fresh && exited == o.exited && path == o.path &&
+                line == o.line && count == o.count;
+        }
+    };
+    auto sig = [](int row) {
+        const Proc& p = RowAt(row);
+        RowSig s{ KeyOf(p), p.rss, p.privateBytes, p.commit, CpuTenths(p.cpu), p.faultRate, p.readRate, p.writeRate, p.fresh, p.exited != 0, p.path, 0, 0 };
+        if (TreeShown() && (size_t)row < g.lines.size()) {
+            const uint32_t i = g.filtered[(size_t)row];
+            s.line = (uint32_t)g.lines[(size_t)row].depth << 16 | g.lines[(size_t)row].mark;
+            if (RowCollapsed(row)) { s.rss = g.tree.subRss[i]; s.cpu = CpuTenths(g.tree.subCpu[i]); s.count = g.tree.subCount[i]; }
+        }
+        return s;
+    };
+    std::vector<RowSig> before; before.reserve(g.filtered.size());
+    int focusRow;
+    {
+        StageTimer timer(StageList); // list = this plus the population below, not sort/filter
+        for (int i = 0; i < (int)g.filtered.size(); ++i) before.push_back(sig(i));
+        focusRow = ListView_GetNextItem(lv, -1, LVNI_FOCUSED);
+    }
+
+    g.all.swap(next);
+    g.rowOfStale = true;
+    SortRows();
+    ResetFilter();
     ApplyFilter();
-    ListView_Clear(g.hwndList);
-    ListView_SetItemCount(g.hwndList, (int)g.filtered.size());
-    for (int i = 0; i < (int)g.filtered.size(); ++i) ListView_AddOrSet(g.hwndList, i, g.filtered[i]);
-}
-static std::vector<DWORD> GetSelectedPids() {
-    std::vector<DWORD> pids;
-    int idx = -1;
-    while ((idx = ListView_GetNextItem(g.hwndList, idx, LVNI_SELECTED)) != -1) {
-        wchar_t buf[32] = { 0 };
-        ListView_GetItemText(g.hwndList, idx, 0, buf, 31);
-        buf[31] = L'\0';
-        pids.push_back((DWORD)_wtoi(buf));
-    }
-    return pids;
-}
-static std::unordered_map<DWORD, std::vector<DWORD>> CurrentChildren() {
-    return BuildChildren(g.all);
-}
-static void ActOnSelection(int action/*1=kill 2=suspend 3=resume*/) {
-    auto pids = GetSelectedPids();
-    if (pids.empty()) {
-        MessageBoxW(g.hwnd, L"Select one or more rows first.", L"ProcMonUI", MB_ICONINFORMATION);
+    StageTimer timer(StageList, true);
+    const int n = (int)g.filtered.size(), nBefore = (int)before.size();
+    ListView_SetItemCountEx(lv, n, LVSICF_NOSCROLL | LVSICF_NOINVALIDATEALL);
+
+    int run = -1;
+    for (int i = 0; i <= n; ++i) {
+        const bool same = i < n && i < nBefore && before[(size_t)i] == sig(i);
+        if (!same && i < n) {
+            if (i >= g.cacheFrom && i < g.cacheFrom + (int)g.cache.size()) FormatRow(i, g.cache[(size_t)(i - g.cacheFrom)]);
+            if (run < 0) run = i;
+        }
+        else if (run >= 0) { ListView_RedrawItems(lv, run, i - 1); run = -1; }
+    }
+    if (n < nBefore) InvalidateRect(lv, nullptr, FALSE); // rows vanished from the bottom
+
+    if (!g.selected.empty()) { // forget processes that exited
+        std::unordered_set<ProcKey, ProcKeyHash> alive; alive.reserve(g.all.size());
+        for (const Proc& p : g.all) alive.insert(KeyOf(p));
+        for (auto it = g.selected.begin(); it != g.selected.end();) it = alive.count(*it) ? std::next(it) : g.selected.erase(it);
+    }
+    SyncSelection(lv);
+    if (focusRow < 0 || focusRow >= nBefore) return;
+    const ProcKey focus = before[(size_t)focusRow].key;
+    for (int i = 0; i < n; ++i) {
+        if (!(KeyOf(RowAt(i)) == focus)) continue;
+        if (i != focusRow) ListView_SetItemState(lv, i, LVIS_FOCUSED, LVIS_FOCUSED);
+        break;
+    }
+}
+// Re-derive g.filtered with `rebuild`; selection and focus stay on their processes.
+template <class Fn>
+static void ReshowKeepingSelection(HWND lv, Fn rebuild) {
+    const int focusRow = ListView_GetNextItem(lv, -1, LVNI_FOCUSED);
+    const bool hadFocus = focusRow >= 0;
+    const ProcKey focus = hadFocus ? RowKey(focusRow) : ProcKey{};
+    g.syncingSelection = true;
+    ListView_SetItemState(lv, -1, 0, LVIS_SELECTED | LVIS_FOCUSED);
+    g.syncingSelection = false;
+
+    rebuild();
+    StageTimer timer(StageList); // from here to the end
+    ListView_ShowFiltered(lv);
+    SyncSelection(lv);
+    if (!hadFocus) return;
+    for (int i = 0; i < (int)g.filtered.size(); ++i) {
+        if (!(RowKey(i) == focus)) continue;
+        ListView_SetItemState(lv, i, LVIS_FOCUSED, LVIS_FOCUSED);
+        ListView_EnsureVisible(lv, i, FALSE);
+        break;
+    }
+}
+static void ResortAndFilter() { SortRows(); ResetFilter(); ApplyFilter(); }
+// LVN_COLUMNCLICK: sort by that column; clicking it again flips the direction.
+// Numbers start largest first, text A-Z. In the tree view this orders siblings.
+static void OnColumnClick(HWND lv, int subItem) {
+    if (subItem < 0 || subItem >= (int)g.columns.size()) return;
+    const int c = g.columns[(size_t)subItem];
+    if (c == g.sortColumn) g.sortDescending = !g.sortDescending;
+    else { g.sortColumn = c; g.sortDescending = !(c == ColName || c == ColPath); }
+    UpdateCollectMask();
+    ListView_ShowSortArrow(lv);
+    ReshowKeepingSelection(lv, ResortAndFilter);
+}
+// Tree view: Right/+ expands, Left/- collapses (or moves to the parent), double-click toggles.
+static void SetTreeExpanded(HWND lv, int row, bool open) {
+    if (!TreeShown() || row < 0 || (size_t)row >= g.lines.size() || g.lines[(size_t)row].mark == L' ') return;
+    if ((g.lines[(size_t)row].mark == L'-') == open) return;
+    g.expanded[KeyOf(RowAt(row))] = open;
+    ReshowKeepingSelection(lv, BuildTreeRows);
+}
+static void OnTreeKey(HWND lv, WORD vk) {
+    const int row = ListView_GetNextItem(lv, -1, LVNI_FOCUSED);
+    if (row < 0 || (size_t)row >= g.lines.size()) return;
+    const AppState::TreeLine t = g.lines[(size_t)row];
+    if (vk == VK_RIGHT || vk == VK_ADD) SetTreeExpanded(lv, row, true);
+    else if ((vk == VK_LEFT || vk == VK_SUBTRACT) && t.mark == L'-') SetTreeExpanded(lv, row, false);
+    else if (vk == VK_LEFT && t.depth > 0) {
+        int up = row;
+        while (up > 0 && g.lines[(size_t)up].depth >= t.depth) --up;
+        ListView_SetItemState(lv, -1, 0, LVIS_SELECTED | LVIS_FOCUSED);
+        ListView_SetItemState(lv, up, LVIS_SELECTED | LVIS_FOCUSED, LVIS_SELECTED | LVIS_FOCUSED);
+        ListView_EnsureVisible(lv, up, FALSE);
+    }
+}
+static void SetTreeView(bool on) {
+    g.treeView = on;
+    CheckMenuItem(GetMenu(g.hwnd), IDM_VIEW_TREE, MF_BYCOMMAND | (on ? MF_CHECKED : MF_UNCHECKED));
+    if (!on) g.lines.clear();
+    if (!ArchiveOpen()) ReshowKeepingSelection(g.hwndList, ResortAndFilter);
+}
+// View > Track starts/exits (see Process events): events are applied to g.all in
+// batches (kEventTimer), and snapshots reconcile the table. Exited rows stay, grayed,
+// for kExitGraceTicks, so processes that lived between two scans are still seen.
+static const UINT_PTR kEventTimer = 1;
+static const UINT kEventBatchMs = 200, kExitSweepMs = 1000;
+static const ULONGLONG kExitGraceTicks = 5ull * 10000000; // 5 s in FILETIME units
+
+static void NotifyProcessEvents(void* hwnd) { PostMessageW((HWND)hwnd, WM_APP_PROCESS_EVENTS, 0, 0); } // session thread
+static bool ExitExpired(const Proc& p, ULONGLONG now) { return p.exited && now >= p.exited && now - p.exited >= kExitGraceTicks; }
+static bool AnyExited(const std::vector<Proc>& v) { return std::any_of(v.begin(), v.end(), [](const Proc& p) { return p.exited != 0; }); }
+// Come back to drop exited rows once their grace period is over.
+static void ScheduleExitSweep() {
+    if (!g.eventsDue && AnyExited(g.all)) SetTimer(g.hwnd, kEventTimer, kExitSweepMs, nullptr);
+}
+// Carry what a snapshot whose scan began at `scanAt` can't know over from g.all:
+// processes started after it and exits within their grace period. Rows it still
+// lists as running get their exit stamped. Returns true if `incoming` changed.
+static bool CarryEventRows(std::vector<Proc>& incoming, ULONGLONG scanAt) {
+    const ULONGLONG now = NowFileTime();
+    std::vector<uint32_t> carry;
+    for (uint32_t i = 0; i < (uint32_t)g.all.size(); ++i) {
+        const Proc& p = g.all[i];
+        if (p.exited ? !ExitExpired(p, now) : p.created > scanAt) carry.push_back(i);
+    }
+    if (carry.empty()) return false;
+    std::unordered_map<ProcKey, size_t, ProcKeyHash> at;
+    for (size_t i = 0; i < incoming.size(); ++i) at.emplace(KeyOf(incoming[i]), i);
+    for (uint32_t i : carry) {
+        const Proc& p = g.all[i];
+        auto it = at.find(KeyOf(p));
+        if (it == at.end()) { incoming.push_back(p); g.anyFresh |= p.fresh; }
+        else if (p.exited) { Proc& q = incoming[it->second]; q.exited = p.exited; q.cpu = q.faultRate = q.readRate = q.writeRate = 0; }
+    }
+    return true;
+}
+
+// Events in the flat live view are applied in place: a start is appended to g.all and
+// inserted into g.order, each filter level and g.filtered at its sorted position; an
+// exit moves its row to where its zeroed rates sort; expired rows are cut out of
+// g.all and the index lists renumbered. Only rows from the first one affected down
+// are repainted. (The tree view rebuilds: a start can reshape any subtree.)
+static const uint32_t kNoRow = UINT32_MAX;
+static uint32_t FindRow(const ProcKey& k) {
+    if (g.rowOfStale) {
+        g.rowOf.clear();
+        g.rowOf.reserve(g.all.size());
+        for (uint32_t i = 0; i < (uint32_t)g.all.size(); ++i) g.rowOf.emplace(KeyOf(g.all[i]), i);
+        g.rowOfStale = false;
+    }
+    auto it = g.rowOf.find(k);
+    return it == g.rowOf.end() ? kNoRow : it->second;
+}
+// The order SortRows gives g.order (strings compare folded, ties by row).
+static bool RowBefore(uint32_t x, uint32_t y) {
+    const Proc& a = g.all[x];
+    const Proc& b = g.all[y];
+    const int c = g.sortColumn;
+    if (c == ColName || c == ColPath) {
+        const std::wstring_view s = g_strings.Folded(c == ColName ? a.name : a.path), t = g_strings.Folded(c == ColName ? b.name : b.path);
+        if (s != t) return g.sortDescending ? s > t : s < t;
+    }
+    else {
+        const uint64_t kx = NumericKey(a, c), ky = NumericKey(b, c);
+        if (kx != ky) return g.sortDescending ? kx > ky : kx < ky;
+    }
+    return x < y;
+}
+static bool RowMatchesNeedle(const Proc& p, const std::wstring& needle) {
+    auto has = [&](uint32_t id) {
+        const std::wstring_view s = g_strings.Folded(id);
+        return ContainsFolded(s.data(), s.size(), needle.data(), needle.size());
+    };
+    return needle.empty() || has(p.name) || has(p.path);
+}
+// Position of row `j` in the sorted list `v`, which must contain it.
+static size_t LocateRow(const std::vector<uint32_t>& v, uint32_t j) {
+    auto it = std::lower_bound(v.begin(), v.end(), j, RowBefore);
+    if (it == v.end() || *it != j) it = std::find(v.begin(), v.end(), j); // a path patched in since the sort
+    return (size_t)(it - v.begin());
+}
+static size_t InsertRow(std::vector<uint32_t>& v, uint32_t j) {
+    return (size_t)(v.insert(std::lower_bound(v.begin(), v.end(), j, RowBefore), j) - v.begin());
+}
+// fn(list, needle) for g.order, each filter level and g.filtered (last).
+template <class Fn>
+static void ForEachRowList(Fn fn) {
+    static const std::wstring all;
+    fn(g.order, all);
+    for (AppState::FilterLevel& l : g.filterStack) fn(l.rows, l.needle);
+    fn(g.filtered, g.filteredNeedle);
+}
+// Set the control's selection bits from g.selected for rows `from` and below.
+static void SyncSelectionFrom(HWND lv, size_t from) {
+    g.syncingSelection = true;
+    for (int i = (int)from - 1; (i = ListView_GetNextItem(lv, i, LVNI_SELECTED)) != -1;)
+        if (!g.selected.count(RowKey(i))) ListView_SetItemState(lv, i, 0, LVIS_SELECTED);
+    for (const ProcKey& k : g.selected) {
+        const uint32_t j = FindRow(k);
+        if (j == kNoRow || !RowMatchesNeedle(g.all[j], g.filteredNeedle)) continue;
+        const size_t at = LocateRow(g.filtered, j);
+        if (at >= from && at < g.filtered.size() && !ListView_GetItemState(lv, (int)at, LVIS_SELECTED))
+            ListView_SetItemState(lv, (int)at, LVIS_SELECTED, LVIS_SELECTED);
+    }
+    g.syncingSelection = false;
+}
+// g.filtered positions [first, last] changed; `shifted`: rows were added or removed,
+// so everything from `first` down moved.
+struct RowSpan { size_t first = SIZE_MAX, last = 0; bool shifted = false; };
+static RowSpan ApplyEventsInPlace(ULONGLONG now) {
+    RowSpan span;
+    auto touch = [&](size_t at, const std::vector<uint32_t>& list, bool shifts) {
+        if (&list != &g.filtered) return;
+        span.first = std::min(span.first, at);
+        span.last = std::max(span.last, at);
+        span.shifted |= shifts;
+    };
+    for (const ProcEvent& e : g.eventBatch) {
+        const uint32_t j = FindRow(ProcKey{ e.pid, e.created });
+        if (!e.exit) {
+            if (j != kNoRow) continue;
+            const uint32_t row = (uint32_t)g.all.size();
+            g.all.push_back(StartedRow(e));
+            g.rowOf.emplace(ProcKey{ e.pid, e.created }, row);
+            g.anyFresh = true;
+            ForEachRowList([&](std::vector<uint32_t>& v, const std::wstring& needle) {
+                if (RowMatchesNeedle(g.all[row], needle)) touch(InsertRow(v, row), v, true);
+            });
+            continue;
+        }
+        if (j == kNoRow || g.all[j].exited) continue;
+        std::vector<std::vector<uint32_t>*> in; // lists to put it back into, once its sort key changed
+        ForEachRowList([&](std::vector<uint32_t>& v, const std::wstring& needle) {
+            if (!RowMatchesNeedle(g.all[j], needle)) return;
+            const size_t at = LocateRow(v, j);
+            if (at == v.size()) return;
+            touch(at, v, false);
+            v.erase(v.begin() + (ptrdiff_t)at);
+            in.push_back(&v);
+        });
+        MarkExited(g.all[j], e.time);
+        for (std::vector<uint32_t>* v : in) touch(InsertRow(*v, j), *v, false);
+    }
+    // Expired exits: compact g.all, renumbering the lists (the order is unchanged).
+    std::vector<uint32_t> remap;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < (uint32_t)g.all.size(); ++i) {
+        const bool drop = ExitExpired(g.all[i], now);
+        if (drop && remap.empty()) { remap.resize(g.all.size()); for (uint32_t k = 0; k < i; ++k) remap[k] = k; }
+        if (remap.empty()) { ++kept; continue; }
+        if (drop) { remap[i] = kNoRow; g.selected.erase(KeyOf(g.all[i])); continue; }
+        remap[i] = kept;
+        g.all[kept++] = g.all[i];
+    }
+    if (remap.empty()) return span;
+    g.all.resize(kept);
+    g.rowOfStale = true;
+    ForEachRowList([&](std::vector<uint32_t>& v, const std::wstring&) {
+        size_t out = 0;
+        for (size_t k = 0; k < v.size(); ++k) {
+            if (remap[v[k]] == kNoRow) { touch(k, v, true); continue; }
+            v[out++] = remap[v[k]];
+        }
+        v.resize(out);
+    });
+    return span;
+}
+// kEventTimer: apply the queued events and drop expired exits.
+static void OnProcessEvents() {
+    TakeProcessEvents(g.eventBatch);
+    const ULONGLONG now = NowFileTime();
+    if (ArchiveOpen() || TreeShown()) {
+        // Behind an archive g.all isn't shown, so patch it directly; the tree view gets a
+        // patched copy, so UpdateFilteredView repaints only the rows that changed.
+        std::vector<Proc>& v = ArchiveOpen() ? g.all : g.incoming;
+        if (&v != &g.all) v.assign(g.all.begin(), g.all.end());
+        bool changed = ApplyProcEvents(v, g.eventBatch);
+        const size_t before = v.size();
+        v.erase(std::remove_if(v.begin(), v.end(), [now](const Proc& p) { return ExitExpired(p, now); }), v.end());
+        changed |= v.size() != before;
+        if (changed) {
+            g.anyFresh |= std::any_of(g.eventBatch.begin(), g.eventBatch.end(), [](const ProcEvent& e) { return !e.exit; });
+            g.rowOfStale = true;
+            if (!ArchiveOpen()) UpdateFilteredView(g.hwndList, v);
+        }
+        ScheduleExitSweep();
+        return;
+    }
+    HWND lv = g.hwndList;
+    const int focusRow = ListView_GetNextItem(lv, -1, LVNI_FOCUSED);
+    const bool hadFocus = focusRow >= 0 && focusRow < (int)g.filtered.size();
+    const ProcKey focus = hadFocus ? KeyOf(RowAt(focusRow)) : ProcKey{};
+    const size_t nBefore = g.filtered.size();
+    const RowSpan span = ApplyEventsInPlace(now);
+    if (span.first != SIZE_MAX) {
+        StageTimer timer(StageList);
+        const size_t n = g.filtered.size(), first = span.first;
+        const size_t last = span.shifted || span.last >= n ? (n ? n - 1 : 0) : span.last;
+        ListView_SetItemCountEx(lv, (int)n, LVSICF_NOSCROLL | LVSICF_NOINVALIDATEALL);
+        const size_t cacheEnd = (size_t)g.cacheFrom + g.cache.size();
+        for (size_t i = std::max(first, (size_t)g.cacheFrom); i <= last && i < std::min(n, cacheEnd); ++i) FormatRow((int)i, g.cache[i - (size_t)g.cacheFrom]);
+        if (first < n) ListView_RedrawItems(lv, (int)first, (int)last);
+        if (n < nBefore) InvalidateRect(lv, nullptr, FALSE); // rows vanished from the bottom
+        SyncSelectionFrom(lv, first);
+        if (hadFocus && (size_t)focusRow >= first) {
+            const uint32_t j = FindRow(focus);
+            const size_t at = j == kNoRow || !RowMatchesNeedle(g.all[j], g.filteredNeedle) ? n : LocateRow(g.filtered, j);
+            if (at < n && at != (size_t)focusRow) ListView_SetItemState(lv, (int)at, LVIS_FOCUSED, LVIS_FOCUSED);
+        }
+    }
+    ScheduleExitSweep();
+}
+static void OnSnapshotReady() {
+    ULONGLONG scanAt = 0;
+    if (!TakeSnapshot(g.incoming, g.diff, scanAt)) return;
+    if (g.diff.Empty() && !g.anyFresh) { RecycleSnapshot(g.incoming); return; } // same processes, same RSS and CPU time
+    g.anyFresh = false;
+    for (size_t i : g.diff.added) g.anyFresh |= g.incoming[i].fresh;
+    if (g.tracking) CarryEventRows(g.incoming, scanAt);
+    if (ArchiveOpen()) { g.all.swap(g.incoming); g.rowOfStale = true; } // the list shows the archive; keep g.all current for Close snapshot
+    else UpdateFilteredView(g.hwndList, g.incoming);
+    RecycleSnapshot(g.incoming); // now holds the previous front buffer
+    if (g.tracking) ScheduleExitSweep();
+}
+static void CurrentTree(ProcTree& t) {
+    std::vector<uint32_t> order(g.all.size());
+    for (uint32_t i = 0; i < (uint32_t)order.size(); ++i) order[i] = i;
+    BuildProcTree(g.all, order, t);
+}
+
+// View > Show timings (see Instrumentation): status part 1 holds the stage times and
+// the counters of the latest refresh.
+static const int kStatsPartWidth = 600;
+static void LayoutStatusParts(int width) {
+    int parts[2] = { std::max(width - kStatsPartWidth, width / 3), -1 };
+    if (g.stats) SendMessageW(g.hStatus, SB_SETPARTS, 2, (LPARAM)parts);
+    else SendMessageW(g.hStatus, SB_SETPARTS, 1, (LPARAM)(parts + 1));
+}
+static double StageMs(int s) { return TicksToMs(s == StagePaint ? g.paintLast : g_stats.ticks[s].load(std::memory_order_relaxed)); }
+// `refresh`: a snapshot just came in, so close the counters and the paint time.
+static void ShowStats(bool refresh) {
+    if (refresh) {
+        for (int c = 0; c < CounterCount; ++c) {
+            const uint64_t total = g_stats.count[c].load(std::memory_order_relaxed);
+            g.statsLast[c] = total - g.statsBase[c];
+            g.statsBase[c] = total;
+        }
+        g.paintLast = g_stats.ticks[StagePaint].exchange(0, std::memory_order_relaxed);
+    }
+    wchar_t full[64] = L"";
+    if (const uint64_t dropped = g_strings.Dropped()) swprintf_s(full, L", string pool full (%llu dropped)", (unsigned long long)dropped);
+    wchar_t buf[320];
+    swprintf_s(buf, L"scan %.1f  diff %.1f  sort %.1f  filter %.1f  list %.1f  paint %.1f ms | %llu handles, %llu denied%s",
+        StageMs(StageScan), StageMs(StageDiff), StageMs(StageSort), StageMs(StageFilter), StageMs(StageList), StageMs(StagePaint),
+        (unsigned long long)g.statsLast[CountHandles], (unsigned long long)g.statsLast[CountDenied], full);
+    SendMessageW(g.hStatus, SB_SETTEXT, 1, (LPARAM)buf);
+}
+static void SetStatsShown(bool on) {
+    g.stats = on;
+    g_stats.on.store(on, std::memory_order_relaxed);
+    HMENU menu = GetMenu(g.hwnd);
+    CheckMenuItem(menu, IDM_VIEW_STATS, MF_BYCOMMAND | (on ? MF_CHECKED : MF_UNCHECKED));
+    EnableMenuItem(menu, IDM_VIEW_COPY_STATS, MF_BYCOMMAND | (on ? MF_ENABLED : MF_GRAYED));
+    RECT rc{};
+    GetClientRect(g.hwnd, &rc);
+    LayoutStatusParts(rc.right);
+    if (!on) return;
+    ShowStats(true); // starts the counters from here
+    RefreshData();   // and fills in the timings
+}
+// View > Copy stats: the latest refresh as "name<TAB>value" lines, as text.
+static void CopyStats() {
+    std::wstring text;
+    wchar_t line[64];
+    for (int s = 0; s < StageCount; ++s) {
+        swprintf_s(line, L"%s_ms\t%.3f\r\n", kStageNames[s], StageMs(s));
+        text += line;
+    }
+    for (int c = 0; c < CounterCount; ++c) text += std::wstring(kCounterNames[c]) + L"\t" + std::to_wstring(g.statsLast[c]) + L"\r\n";
+    text += L"rows\t" + std::to_wstring(g.all.size()) + L"\r\nshown\t" + std::to_wstring(g.filtered.size()) + L"\r\n";
+    text += L"strings\t" + std::to_wstring(g_strings.Count()) + L"\r\nstrings_dropped\t" + std::to_wstring(g_strings.Dropped()) + L"\r\n";
+    if (!OpenClipboard(g.hwnd)) return;
+    EmptyClipboard();
+    const size_t bytes = (text.size() + 1) * sizeof(wchar_t);
+    if (HGLOBAL mem = GlobalAlloc(GMEM_MOVEABLE, bytes)) {
+        if (void* p = GlobalLock(mem)) { memcpy(p, text.c_str(), bytes); GlobalUnlock(mem); }
+        if (!SetClipboardData(CF_UNICODETEXT, mem)) GlobalFree(mem);
+    }
+    CloseClipboard();
+}
+
+// -------------------- Background export --------------------
+// Serialization and the file write run on their own thread from a private copy of
+// the visible rows, so refreshes can keep swapping g.all meanwhile. The button that
+// started the export turns into "Cancel"; progress goes to the status bar.
+static const wchar_t kStatusReady[] = L"Ready - Bob Paydar";
+// Status text while no export runs: the fixed text, or what the open archive holds.
+static void ShowIdleStatus() {
+    std::wstring text = kStatusReady;
+    if (ArchiveOpen()) {
+        text = std::wstring(L"Snapshot ") + PathFindFileNameW(g_archive.file.c_str()) + L" - " +
+            ArchiveString(g_archive.hdr->host) + L", " + FormatFileTime(g_archive.hdr->timestamp) + L", " +
+            std::to_wstring(g_archive.hdr->rows) + L" processes";
+        if (g_archive.historyFrames) text += L", " + std::to_wstring(g_archive.historyFrames) + L" history frames";
+    }
+    SendMessageW(g.hStatus, SB_SETTEXT, 0, (LPARAM)text.c_str());
+}
+
+enum ExportFormat : int { ExportJson, ExportCsv, ExportSnapshot };
+struct ExportTask {
+    std::thread thread;
+    std::atomic<bool> cancel{ false };
+    bool running = false; // UI thread only
+    HWND button{};        // the button that started it (now "Cancel"); null from the File menu
+    std::wstring label;   // the button's caption to restore
+    std::wstring path, title;
+};
+static ExportTask g_export;
+
+static bool ExportRunning() { return g_export.running; }
+// `hist` is written along with an ExportSnapshot, `rows` being its keyframe.
+static void StartExport(HWND button, const std::wstring& title, const std::wstring& path, ExportFormat fmt, std::vector<Proc> rows, HistoryLog hist = HistoryLog()) {
+    g_export.running = true;
+    g_export.button = button;
+    g_export.path = path; g_export.title = title;
+    g_export.cancel = false;
+    if (button) {
+        wchar_t caption[64] = { 0 };
+        GetWindowTextW(button, caption, 63);
+        g_export.label = caption;
+        SetWindowTextW(button, L"Cancel");
+    }
+    for (HWND b : { g.hBtnJson, g.hBtnCsv }) if (b != button) EnableWindow(b, FALSE);
+    SendMessageW(g.hStatus, SB_SETTEXT, 0, (LPARAM)L"Exporting... 0%");
+
+    HWND notify = g.hwnd;
+    g_export.thread = std::thread([notify, path, fmt, rows = std::move(rows), hist = std::move(hist)]() mutable {
+        LoadPaths(rows); // rows never scrolled into view
+        int lastPct = -1;
+        auto progress = [&](size_t done, size_t total) {
+            if (g_export.cancel) return false;
+            const int pct = total ? (int)(done * 100 / total) : 100;
+            if (pct != lastPct) { lastPct = pct; PostMessageW(notify, WM_APP_EXPORT_PROGRESS, (WPARAM)pct, 0); }
+            return true;
+        };
+        bool ok;
+        if (fmt == ExportSnapshot) ok = SaveFile(path, [&](Utf8Writer& w) { return WriteSnapshot(w, rows, progress, hist.frames ? &hist : nullptr); });
+        else ok = SaveUtf8File(path, [&](Utf8Writer& w) { return fmt == ExportJson ? WriteJson(w, rows, progress) : WriteCsv(w, rows, progress); });
+        PostMessageW(notify, WM_APP_EXPORT_DONE, ok ? 0 : (WPARAM)GetLastError(), 0);
+    });
+}
+static void OnExportProgress(int pct) {
+    if (!ExportRunning()) return;
+    wchar_t buf[64];
+    swprintf_s(buf, L"Exporting... %d%%", pct);
+    SendMessageW(g.hStatus, SB_SETTEXT, 0, (LPARAM)buf);
+}
+static void OnExportDone(DWORD err) {
+    if (g_export.thread.joinable()) g_export.thread.join();
+    if (!ExportRunning()) return;
+    if (g_export.button) SetWindowTextW(g_export.button, g_export.label.c_str());
+    EnableWindow(g.hBtnJson, TRUE); EnableWindow(g.hBtnCsv, TRUE);
+    g_export.running = false;
+    g_export.button = nullptr;
+    ShowIdleStatus();
+    if (err && err != ERROR_CANCELLED) {
+        std::wstring msg = L"Could not write " + g_export.path + L":\n" + LastErrorMessage(err);
+        MessageBoxW(g.hwnd, msg.c_str(), g_export.title.c_str(), MB_ICONERROR);
+    }
+}
+static void StopExport() {
+    g_export.cancel = true;
+    if (g_export.thread.joinable()) g_export.thread.join();
+}
+// Export button or File > Export snapshot: ask for a file and start, or cancel the
+// running export.
+static void OnExportButton(HWND button, ExportFormat fmt) {
+    if (ExportRunning()) { g_export.cancel = true; return; }
+    if (g.filtered.empty()) {
+        MessageBoxW(g.hwnd, L"No rows to export.", L"Export", MB_ICONINFORMATION);
+        return;
+    }
+    static const struct { const wchar_t* title, * ext, * filter; } kinds[] = {
+        { L"Export JSON", L"json", L"JSON (*.json)\0*.json\0All Files (*.*)\0*.*\0" },
+        { L"Export CSV", L"csv", L"CSV (*.csv)\0*.csv\0All Files (*.*)\0*.*\0" },
+        { L"Export snapshot", L"pms", kPmsFilter },
+    };
+    const auto& k = kinds[fmt];
+    std::wstring path;
+    if (!AskSavePath(k.title, k.ext, k.filter, path)) return;
+    StartExport(button, k.title, path, fmt, FilteredRows());
+}
+// File > Save history: the recorded log with its keyframe, as a .pms file.
+static void OnSaveHistory() {
+    if (ExportRunning()) return;
+    std::vector<Proc> keyframe;
+    HistoryLog log;
+    if (!CopyHistory(keyframe, log)) {
+        MessageBoxW(g.hwnd, L"Nothing recorded yet. Turn on View > Record history first.", L"Save history", MB_ICONINFORMATION);
+        return;
+    }
+    std::wstring path;
+    if (!AskSavePath(L"Save history", L"pms", kPmsFilter, path)) return;
+    StartExport(nullptr, L"Save history", path, ExportSnapshot, std::move(keyframe), std::move(log));
+}
+
+// -------------------- Background actions --------------------
+// Kill/Suspend/Resume run on their own thread while the UI stays live. Progress and
+// the per-PID outcome go to the status bar; afterwards only the victims are
+// re-checked (RunActions waits for killed processes to exit), and confirmed-dead
+// rows are dropped from g.all instead of rescanning the system.
+struct ActionTask {
+    std::thread thread;
+    bool running = false;     // UI thread only
+    int action = 0;
+    std::vector<Victim> victims;
+    std::vector<DWORD> result; // parallel to victims, valid on WM_APP_ACTION_DONE
+};
+static ActionTask g_action;
+
+static const wchar_t* ActionName(int action) { return action == ActKill ? L"Kill" : action == ActSuspend ? L"Suspend" : L"Resume"; }
+static void EnableActions(bool on) {
+    for (HWND b : { g.hBtnKill, g.hBtnSuspend, g.hBtnResume }) EnableWindow(b, on && !ArchiveOpen());
+}
+static void ActOnSelection(int action) {
+    if (g_action.running) return;
+    const std::vector<uint32_t> sel = SelectedRows();
+    if (sel.empty()) {
+        SendMessageW(g.hStatus, SB_SETTEXT, 0, (LPARAM)L"Select one or more rows first.");
         return;
     }
     bool tree = (SendMessageW(g.hChkTree, BM_GETCHECK, 0, 0) == BST_CHECKED);
-    auto ch = CurrentChildren();
-    std::vector<DWORD> victims;
-    for (DWORD pid : pids) {
-        if (tree) CollectTree(pid, ch, victims);
-        else victims.push_back(pid);
+    ProcTree t;
+    CurrentTree(t); // depths order the batch even without Tree
+    std::vector<char> seen(g.all.size());
+    std::vector<uint32_t> rows;
+    std::vector<Victim> victims;
+    for (uint32_t r : sel) {
+        if (tree) CollectTree(g.all[r].pid, t, seen, rows);
+        else if (!seen[r]) { seen[r] = 1; rows.push_back(r); }
+    }
+    for (uint32_t r : rows) victims.push_back(Victim{ g.all[r].pid, g.all[r].created, t.depth[r] });
+
+    g_action.running = true;
+    g_action.action = action;
+    EnableActions(false);
+    const std::wstring text = ActionName(action) + std::wstring(L"... 0/") + std::to_wstring(victims.size());
+    SendMessageW(g.hStatus, SB_SETTEXT, 0, (LPARAM)text.c_str());
+    HWND notify = g.hwnd;
+    g_action.thread = std::thread([notify, action, victims = std::move(victims)]() mutable {
+        auto progress = [&](size_t done, size_t total) {
+            PostMessageW(notify, WM_APP_ACTION_PROGRESS, (WPARAM)done, (LPARAM)total);
+            return true;
+        };
+        g_action.result = RunActions(action, victims, progress);
+        g_action.victims = std::move(victims);
+        PostMessageW(notify, WM_APP_ACTION_DONE, 0, 0);
+    });
+}
+static void OnActionProgress(size_t done, size_t total) {
+    if (!g_action.running) return;
+    wchar_t buf[96];
+    swprintf_s(buf, L"%s... %u/%u", ActionName(g_action.action), (unsigned)done, (unsigned)total);
+    SendMessageW(g.hStatus, SB_SETTEXT, 0, (LPARAM)buf);
+}
+// "Kill: 38 done, 2 access denied - PID 4 System: access denied; PID 88 ..."
+static void OnActionDone() {
+    if (g_action.thread.joinable()) g_action.thread.join();
+    if (!g_action.running) return;
+    g_action.running = false;
+    EnableActions(true);
+    const std::vector<Victim>& v = g_action.victims;
+    const std::vector<DWORD>& r = g_action.result;
+
+    std::vector<std::pair<DWORD, size_t>> tally; // outcome, count (first-seen order)
+    for (DWORD e : r) {
+        auto it = std::find_if(tally.begin(), tally.end(), [&](const std::pair<DWORD, size_t>& t) { return t.first == e; });
+        if (it == tally.end()) tally.emplace_back(e, 1); else ++it->second;
+    }
+    std::wstring text = ActionName(g_action.action) + std::wstring(L":");
+    for (size_t k = 0; k < tally.size(); ++k) text += (k ? L", " : L" ") + std::to_wstring(tally[k].second) + L" " + ActionOutcome(tally[k].first);
+    std::unordered_map<DWORD, uint32_t> nameOf;
+    for (const Proc& p : g.all) nameOf.emplace(p.pid, p.name);
+    const size_t kMaxListed = 4;
+    size_t listed = 0, failed = 0;
+    for (size_t k = 0; k < v.size(); ++k) {
+        if (!r[k]) continue;
+        if (++failed > kMaxListed) continue;
+        text += listed++ ? L"; " : L" - ";
+        text += L"PID " + std::to_wstring(v[k].pid);
+        auto it = nameOf.find(v[k].pid);
+        if (it != nameOf.end() && it->second) text += L" " + std::wstring(g_strings.Text(it->second));
+        text += L": " + ActionOutcome(r[k]);
     }
-    std::sort(victims.begin(), victims.end());
-    victims.erase(std::unique(victims.begin(), victims.end()), victims.end());
+    if (failed > kMaxListed) text += L"; ...";
+    SendMessageW(g.hStatus, SB_SETTEXT, 0, (LPARAM)text.c_str());
+
+    if (g_action.action != ActKill || ArchiveOpen()) return;
+    std::unordered_map<ProcKey, char, ProcKeyHash> gone;
+    for (size_t k = 0; k < v.size(); ++k) if (!r[k] || r[k] == ERROR_NOT_FOUND) gone.emplace(ProcKey{ v[k].pid, v[k].created }, 1);
+    if (gone.empty()) return;
+    auto dead = [&](const Proc& p) { return gone.count(KeyOf(p)) || gone.count(ProcKey{ p.pid, 0 }); };
+    g.all.erase(std::remove_if(g.all.begin(), g.all.end(), dead), g.all.end());
+    g.rowOfStale = true;
+    ReshowKeepingSelection(g.hwndList, ResortAndFilter);
+}
+static void StopActions() {
+    if (g_action.thread.joinable()) g_action.thread.join();
+}
 
-    int ok = 0, fail = 0;
-    for (auto it = victims.rbegin(); it != victims.rend(); ++it) {
-        DWORD pid = *it; bool res = false;
-        if (action == 1) res = TerminatePid(pid);
-        else if (action == 2) res = SuspendPid(pid);
-        else if (action == 3) res = ResumePid(pid);
-        if (res) ++ok; else ++fail;
+// -------------------- Snapshot archive view --------------------
+// File > Open snapshot points the list at a mapped .pms file. The filter and the
+// exports work on it as usual; process actions are disabled, and snapshots keep
+// landing in g.all so Close snapshot returns straight to the live list.
+static void ShowCurrentRows() { // after the row source changed
+    ListView_SetItemState(g.hwndList, -1, 0, LVIS_SELECTED | LVIS_FOCUSED);
+    g.selected.clear();
+    SortRows();
+    ResetFilter();
+    ApplyFilter();
+    ListView_ShowFiltered(g.hwndList);
+    const bool archive = ArchiveOpen();
+    for (HWND b : { g.hBtnRefresh, g.hChkTree }) EnableWindow(b, !archive);
+    EnableActions(!g_action.running);
+    EnableMenuItem(GetMenu(g.hwnd), IDM_FILE_CLOSE, MF_BYCOMMAND | (archive ? MF_ENABLED : MF_GRAYED));
+    EnableMenuItem(GetMenu(g.hwnd), IDM_VIEW_TREE, MF_BYCOMMAND | (archive ? MF_GRAYED : MF_ENABLED));
+    if (!ExportRunning()) ShowIdleStatus();
+}
+static void OnOpenSnapshot() {
+    std::wstring path;
+    if (!AskOpenPath(L"Open snapshot", kPmsFilter, path)) return;
+    SnapshotArchive a;
+    if (!MapArchive(path, a)) {
+        const DWORD err = GetLastError();
+        std::wstring msg = L"Could not open " + path + L":\n" + LastErrorMessage(err);
+        MessageBoxW(g.hwnd, msg.c_str(), L"Open snapshot", MB_ICONERROR);
+        return;
     }
-    std::wstringstream ss; ss << L"OK=" << ok << L" FAIL=" << fail;
-    MessageBoxW(g.hwnd, ss.str().c_str(), L"Action result", fail ? MB_ICONWARNING : MB_ICONINFORMATION);
+    CloseArchive();
+    g_archive = std::move(a);
+    ShowCurrentRows();
+}
+static void OnCloseSnapshot() {
+    if (!ArchiveOpen()) return;
+    CloseArchive();
+    ShowCurrentRows();
+    RefreshData();
 }
 
 // -------------------- Window Proc --------------------
@@ -369,6 +1602,26 @@ LRESULT CALLBACK WndProc(HWND h, UINT m, WPARAM w, LPARAM l) {
     switch (m) {
     case WM_CREATE: {
         g.hwnd = h;
+
+        // Menu bar
+        HMENU bar = CreateMenu(), file = CreatePopupMenu(), view = CreatePopupMenu();
+        AppendMenuW(file, MF_STRING, IDM_FILE_OPEN, L"&Open snapshot...");
+        AppendMenuW(file, MF_STRING, IDM_FILE_EXPORT, L"&Export snapshot...");
+        AppendMenuW(file, MF_STRING, IDM_FILE_HISTORY, L"Save &history...");
+        AppendMenuW(file, MF_SEPARATOR, 0, nullptr);
+        AppendMenuW(file, MF_STRING | MF_GRAYED, IDM_FILE_CLOSE, L"&Close snapshot");
+        AppendMenuW(view, MF_STRING, IDM_VIEW_LIVE, L"&Live update");
+        AppendMenuW(view, MF_STRING, IDM_VIEW_RECORD, L"&Record history");
+        AppendMenuW(view, MF_STRING, IDM_VIEW_TREE, L"Process &tree");
+        AppendMenuW(view, MF_STRING, IDM_VIEW_SHARE, L"&Share snapshots");
+        AppendMenuW(view, MF_STRING, IDM_VIEW_EVENTS, L"Track starts/e&xits");
+        AppendMenuW(view, MF_SEPARATOR, 0, nullptr);
+        AppendMenuW(view, MF_STRING, IDM_VIEW_STATS, L"Show t&imings");
+        AppendMenuW(view, MF_STRING | MF_GRAYED, IDM_VIEW_COPY_STATS, L"&Copy stats");
+        AppendMenuW(bar, MF_POPUP, (UINT_PTR)file, L"&File");
+        AppendMenuW(bar, MF_POPUP, (UINT_PTR)view, L"&View");
+        SetMenu(h, bar);
+
         INITCOMMONCONTROLSEX icc{ sizeof(icc), ICC_LISTVIEW_CLASSES | ICC_STANDARD_CLASSES | ICC_BAR_CLASSES };
         InitCommonControlsEx(&icc);
 
@@ -397,7 +1650,7 @@ LRESULT CALLBACK WndProc(HWND h, UINT m, WPARAM w, LPARAM l) {
             950, 10, 110, 24, h, (HMENU)IDC_BTN_CSV, nullptr, nullptr);
 
         // ListView
-        g.hwndList = CreateWindowExW(WS_EX_CLIENTEDGE, WC_LISTVIEWW, L"", WS_CHILD | WS_VISIBLE | LVS_REPORT | LVS_SHOWSELALWAYS | LVS_SINGLESEL,
+        g.hwndList = CreateWindowExW(WS_EX_CLIENTEDGE, WC_LISTVIEWW, L"", WS_CHILD | WS_VISIBLE | LVS_REPORT | LVS_SHOWSELALWAYS | LVS_OWNERDATA,
             10, 44, 1060, 520, h, (HMENU)IDC_LIST, GetModuleHandleW(nullptr), nullptr);
         ListView_SetExtendedListViewStyle(g.hwndList, LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER | LVS_EX_GRIDLINES);
         ListView_SetupColumns(g.hwndList);
@@ -412,11 +1665,12 @@ LRESULT CALLBACK WndProc(HWND h, UINT m, WPARAM w, LPARAM l) {
         int parts[1] = { -1 };
         SendMessageW(g.hStatus, SB_SETPARTS, 1, (LPARAM)parts);
         SendMessageW(g.hStatus, WM_SIZE, 0, 0);
-        SendMessageW(g.hStatus, SB_SETTEXT, 0, (LPARAM)L"Ready - Bob Paydar");
+        SendMessageW(g.hStatus, SB_SETTEXT, 0, (LPARAM)kStatusReady);
 
         LoadNtFunctions();
 
-        // One-time initial load
+        // One-time initial load (asynchronous; the list fills in on WM_APP_SNAPSHOT)
+        StartSnapshotWorker(h);
         RefreshData();
         return 0;
     }
@@ -424,8 +1678,13 @@ LRESULT CALLBACK WndProc(HWND h, UINT m, WPARAM w, LPARAM l) {
     case WM_SIZE: {
         int wClient = LOWORD(l), hClient = HIWORD(l);
 
+        // Coming back from minimized: don't wait out the stretched live interval
+        const bool wasMinimized = g.minimized;
+        g.minimized = (w == SIZE_MINIMIZED);
+        if (wasMinimized && !g.minimized && g.live) RefreshData();
+
         // Let status bar size itself; then measure its height
-        if (g.hStatus) SendMessageW(g.hStatus, WM_SIZE, 0, 0);
+        if (g.hStatus) { SendMessageW(g.hStatus, WM_SIZE, 0, 0); LayoutStatusParts(wClient); }
         RECT rcStatus{}; int statusH = 0;
         if (g.hStatus && GetWindowRect(g.hStatus, &rcStatus))
             statusH = rcStatus.bottom - rcStatus.top;
@@ -455,73 +1714,313 @@ LRESULT CALLBACK WndProc(HWND h, UINT m, WPARAM w, LPARAM l) {
             GetWindowTextW(g.hSearch, buf, 511);
             buf[511] = L'\0';
             g.filter = buf;
+            g.needle = ToLower(g.filter);
+            UpdateCollectMask(); // a filter needs every path
             ApplyFilter();
-            ListView_Clear(g.hwndList);
-            ListView_SetItemCount(g.hwndList, (int)g.filtered.size());
-            for (int i = 0; i < (int)g.filtered.size(); ++i) ListView_AddOrSet(g.hwndList, i, g.filtered[i]);
+            ListView_ShowFiltered(g.hwndList);
+            if (g.stats) ShowStats(false);
             return 0;
         }
 
         switch (ctrlId) {
+        case IDM_FILE_OPEN:
+            OnOpenSnapshot();
+            break;
+
+        case IDM_FILE_EXPORT: // binary snapshot of the visible rows
+            OnExportButton(nullptr, ExportSnapshot);
+            break;
+
+        case IDM_FILE_CLOSE:
+            OnCloseSnapshot();
+            break;
+
+        case IDM_FILE_HISTORY:
+            OnSaveHistory();
+            break;
+
+        case IDM_VIEW_RECORD:
+            g.recording = !g.recording;
+            CheckMenuItem(GetMenu(h), IDM_VIEW_RECORD, MF_BYCOMMAND | (g.recording ? MF_CHECKED : MF_UNCHECKED));
+            SetRecording(g.recording);
+            UpdateCollectMask();
+            if (g.recording) RefreshData(); // keyframe now
+            break;
+
+        case IDM_VIEW_TREE:
+            SetTreeView(!g.treeView);
+            return 0;
+        case IDM_VIEW_STATS:
+            SetStatsShown(!g.stats);
+            return 0;
+        case IDM_VIEW_COPY_STATS:
+            CopyStats();
+            return 0;
+        case IDM_VIEW_SHARE:
+            if (!g.sharing && !OpenSharedSnapshot()) {
+                const DWORD err = GetLastError();
+                std::wstring msg = std::wstring(L"Could not create ") + kShmName + L":\n" +
+                    (err == ERROR_ALREADY_EXISTS ? L"another instance is already sharing snapshots." : LastErrorMessage(err));
+                MessageBoxW(h, msg.c_str(), L"Share snapshots", MB_ICONERROR);
+                return 0;
+            }
+            g.sharing = !g.sharing;
+            CheckMenuItem(GetMenu(h), IDM_VIEW_SHARE, MF_BYCOMMAND | (g.sharing ? MF_CHECKED : MF_UNCHECKED));
+            UpdateCollectMask();
+            SetSharing(g.sharing);
+            if (!g.sharing) CloseSharedSnapshot(); // after the worker's current publish; frees the writer mutex
+            return 0;
+        case IDM_VIEW_EVENTS:
+            if (!g.tracking && !StartProcessEvents(NotifyProcessEvents, h)) {
+                const DWORD err = GetLastError();
+                std::wstring msg = L"Could not start the process event session:\n" +
+                    (err == ERROR_ACCESS_DENIED ? std::wstring(L"administrator rights (or Performance Log Users) are required.") : LastErrorMessage(err)) +
+                    L"\nStarts and exits are picked up by refreshes instead.";
+                MessageBoxW(h, msg.c_str(), L"Track starts/exits", MB_ICONERROR);
+                return 0;
+            }
+            if (g.tracking) StopProcessEvents();
+            g.tracking = !g.tracking;
+            CheckMenuItem(GetMenu(h), IDM_VIEW_EVENTS, MF_BYCOMMAND | (g.tracking ? MF_CHECKED : MF_UNCHECKED));
+            SetTracking(g.tracking);
+            return 0;
+        case IDM_VIEW_LIVE:
+            g.live = !g.live;
+            CheckMenuItem(GetMenu(h), IDM_VIEW_LIVE, MF_BYCOMMAND | (g.live ? MF_CHECKED : MF_UNCHECKED));
+            SetLiveMode(g.live);
+            break;
+
         case IDC_BTN_REFRESH:
             RefreshData();
             break;
 
-        case IDC_BTN_KILL:
-            ActOnSelection(1);
-            RefreshData(); // auto-refresh after click
+        case IDC_BTN_KILL: // re-checks only the victims when done; no rescan
+            ActOnSelection(ActKill);
             break;
 
         case IDC_BTN_SUSPEND:
-            ActOnSelection(2);
-            RefreshData(); // auto-refresh after click
+            ActOnSelection(ActSuspend);
             break;
 
         case IDC_BTN_RESUME:
-            ActOnSelection(3);
-            RefreshData(); // auto-refresh after click
+            ActOnSelection(ActResume);
             break;
 
-        case IDC_BTN_JSON: {
-            if (g.filtered.empty()) {
-                MessageBoxW(h, L"No rows to export.", L"Export", MB_ICONINFORMATION);
-            }
-            else {
-                auto json = BuildJson(g.filtered);
-                SaveWithDialog(L"Export JSON", L"json",
-                    L"JSON (*.json)\0*.json\0All Files (*.*)\0*.*\0", json);
-            }
-            RefreshData(); // auto-refresh after click
+        case IDC_BTN_JSON: // exports a copy of the visible rows; no re-snapshot needed
+            OnExportButton(g.hBtnJson, ExportJson);
+            break;
+
+        case IDC_BTN_CSV:
+            OnExportButton(g.hBtnCsv, ExportCsv);
             break;
         }
-        case IDC_BTN_CSV: {
-            if (g.filtered.empty()) {
-                MessageBoxW(h, L"No rows to export.", L"Export", MB_ICONINFORMATION);
+        return 0;
+    }
+
+    case WM_NOTIFY: {
+        const NMHDR* nh = (const NMHDR*)l;
+        if (nh->idFrom == IDC_LIST) {
+            if (nh->code == LVN_GETDISPINFOW) { ListView_GetDispInfo((NMLVDISPINFOW*)l); return 0; }
+            if (nh->code == LVN_ODCACHEHINT) {
+                const NMLVCACHEHINT* ch = (const NMLVCACHEHINT*)l;
+                ListView_CacheHint(ch->iFrom, ch->iTo);
+                return 0;
             }
-            else {
-                auto csv = BuildCsv(g.filtered);
-                SaveWithDialog(L"Export CSV", L"csv",
-                    L"CSV (*.csv)\0*.csv\0All Files (*.*)\0*.*\0", csv);
+            if (nh->code == NM_CUSTOMDRAW) return ListView_CustomDraw((NMLVCUSTOMDRAW*)l);
+            if (nh->code == LVN_ITEMCHANGED) {
+                const NMLISTVIEW* nm = (const NMLISTVIEW*)l;
+                if ((nm->uChanged & LVIF_STATE) && ((nm->uNewState ^ nm->uOldState) & LVIS_SELECTED))
+                    OnSelectionChanged(nm->iItem, nm->iItem, (nm->uNewState & LVIS_SELECTED) != 0);
+                return 0;
+            }
+            if (nh->code == LVN_ODSTATECHANGED) { // shift-click ranges
+                const NMLVODSTATECHANGE* od = (const NMLVODSTATECHANGE*)l;
+                if ((od->uNewState ^ od->uOldState) & LVIS_SELECTED) OnSelectionChanged(od->iFrom, od->iTo, (od->uNewState & LVIS_SELECTED) != 0);
+                return 0;
+            }
+            if (nh->code == LVN_COLUMNCLICK) { OnColumnClick(g.hwndList, ((const NMLISTVIEW*)l)->iSubItem); return 0; }
+            if (nh->code == LVN_KEYDOWN && TreeShown()) { OnTreeKey(g.hwndList, ((const NMLVKEYDOWN*)l)->wVKey); return 0; }
+            if (nh->code == NM_DBLCLK && TreeShown()) {
+                const int row = ((const NMITEMACTIVATE*)l)->iItem;
+                if (row >= 0 && (size_t)row < g.lines.size()) SetTreeExpanded(g.hwndList, row, g.lines[(size_t)row].mark == L'+');
+                return 0;
             }
-            RefreshData(); // auto-refresh after click
-            break;
         }
+        break;
+    }
+
+    case WM_CONTEXTMENU:
+        if ((HWND)w == ListView_GetHeader(g.hwndList)) {
+            ListView_ColumnMenu(g.hwndList, GET_X_LPARAM(l), GET_Y_LPARAM(l));
+            return 0;
         }
+        break;
+
+    case WM_APP_SNAPSHOT:
+        OnSnapshotReady();
+        if (g.stats) ShowStats(true);
+        return 0;
+
+    case WM_APP_PROCESS_EVENTS:
+        if (!g.eventsDue) { g.eventsDue = true; SetTimer(h, kEventTimer, kEventBatchMs, nullptr); }
+        return 0;
+
+    case WM_APP_PATHS:
+        OnPathsLoaded();
+        return 0;
+
+    case WM_TIMER:
+        if (w != kEventTimer) break;
+        KillTimer(h, kEventTimer);
+        g.eventsDue = false;
+        OnProcessEvents();
+        return 0;
+
+    case WM_APP_EXPORT_PROGRESS:
+        OnExportProgress((int)w);
+        return 0;
+
+    case WM_APP_EXPORT_DONE:
+        OnExportDone((DWORD)w);
+        return 0;
+
+    case WM_APP_ACTION_PROGRESS:
+        OnActionProgress((size_t)w, (size_t)l);
+        return 0;
+
+    case WM_APP_ACTION_DONE:
+        OnActionDone();
         return 0;
-    }
 
     case WM_DESTROY:
+        StopExport();
+        StopActions();
+        StopProcessEvents();
+        StopPathLoader();
+        StopSnapshotWorker();
+        CloseSharedSnapshot();
+        CloseArchive();
         PostQuitMessage(0);
         return 0;
     }
     return DefWindowProcW(h, m, w, l);
 }
 
+// -------------------- Command line --------------------
+//   ProcMonUI.exe [--json | --csv | --binary] [--watch <seconds>]
+//   ProcMonUI.exe --kill-tree <pid>
+//   ProcMonUI.exe --share [--watch <seconds>]
+// Headless: no window and no common controls, same engine as the GUI. Output streams
+// to stdout (a pipe, a redirect, or the console it was started from): JSON/CSV
+// without BOM, --binary as a .pms image. --watch repeats every <seconds> until stdout
+// closes, one complete document each time (JSON: one per line); CPU % needs an
+// interval, so it is 0 in the first. --kill-tree kills <pid> and its descendants and
+// prints "pid<TAB>name<TAB>outcome" per process; it takes no other switch. --share publishes each snapshot to
+// the shared section (see Shared snapshot) instead of stdout, every second unless
+// --watch says otherwise, until the process is ended.
+// Exit code: 0 ok, 1 something failed, 2 bad arguments.
+static const wchar_t kCliUsage[] =
+    L"usage: ProcMonUI [--json | --csv | --binary] [--watch <seconds>]\r\n"
+    L"       ProcMonUI --kill-tree <pid>\r\n"
+    L"       ProcMonUI --share [--watch <seconds>]\r\n";
+static HANDLE CliStream(DWORD which) {
+    HANDLE h = GetStdHandle(which);
+    if (h && h != INVALID_HANDLE_VALUE) return h;
+    // GUI subsystem: borrow the parent's console, opened once for stdout and stderr alike
+    // (closed by process exit).
+    static const HANDLE conout = AttachConsole(ATTACH_PARENT_PROCESS)
+        ? CreateFileW(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr)
+        : INVALID_HANDLE_VALUE;
+    return conout;
+}
+static void CliError(const std::wstring& text) {
+    Utf8Writer w(CliStream(STD_ERROR_HANDLE));
+    w.Text(text.data(), text.size());
+}
+static int CliKillTree(DWORD pid, Utf8Writer& out) {
+    std::vector<Proc> v;
+    Snapshot(v, 0);
+    std::vector<uint32_t> order(v.size());
+    for (uint32_t i = 0; i < (uint32_t)order.size(); ++i) order[i] = i;
+    ProcTree t;
+    BuildProcTree(v, order, t);
+    std::vector<char> seen;
+    std::vector<uint32_t> rows;
+    if (!CollectTree(pid, t, seen, rows)) { CliError(L"PID " + std::to_wstring(pid) + L" is not running\r\n"); return 1; }
+    std::vector<Victim> victims;
+    for (uint32_t r : rows) victims.push_back(Victim{ v[r].pid, v[r].created, t.depth[r] });
+    const std::vector<DWORD> err = RunActions(ActKill, victims);
+    std::unordered_map<DWORD, uint32_t> nameOf;
+    for (const Proc& p : v) nameOf.emplace(p.pid, p.name);
+    int rc = 0;
+    for (size_t k = 0; k < victims.size(); ++k) {
+        if (err[k] && err[k] != ERROR_NOT_FOUND) rc = 1;
+        const std::wstring line = std::to_wstring(victims[k].pid) + L"\t" + std::wstring(g_strings.Text(nameOf[victims[k].pid])) +
+            L"\t" + ActionOutcome(err[k]) + L"\n";
+        out.Text(line.data(), line.size());
+    }
+    return rc;
+}
+// Returns -1 when there are no arguments (start the GUI), else the exit code.
+static int RunCommandLine(int argc, wchar_t** argv) {
+    if (argc <= 1 || !argv) return -1;
+    ExportFormat fmt = ExportJson;
+    double every = 0;
+    DWORD killPid = 0;
+    bool kill = false, share = false, output = false; // output: a format or --watch was given
+    for (int i = 1; i < argc; ++i) {
+        const std::wstring a = argv[i];
+        const wchar_t* next = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (a == L"--json") { fmt = ExportJson; output = true; }
+        else if (a == L"--csv") { fmt = ExportCsv; output = true; }
+        else if (a == L"--binary") { fmt = ExportSnapshot; output = true; }
+        else if (a == L"--watch" && next && (every = wcstod(next, nullptr)) > 0) { output = true; ++i; }
+        else if (a == L"--share") share = true;
+        else if (a == L"--kill-tree" && next && (killPid = wcstoul(next, nullptr, 10)) != 0) { kill = true; ++i; }
+        else if (a == L"--help" || a == L"-h" || a == L"/?") { CliError(kCliUsage); return 0; }
+        else { CliError(L"bad argument: " + a + L"\r\n" + kCliUsage); return 2; }
+    }
+    if (kill && (share || output)) { CliError(kCliUsage); return 2; } // --kill-tree stands alone
+    if (share && !OpenSharedSnapshot()) {
+        const DWORD err = GetLastError();
+        CliError(std::wstring(L"could not create ") + kShmName + L": " +
+            (err == ERROR_ALREADY_EXISTS ? L"another instance is already sharing snapshots\r\n" : LastErrorMessage(err) + L"\r\n"));
+        return 1;
+    }
+    if (share && every <= 0) every = 1;
+    const HANDLE stream = share ? nullptr : CliStream(STD_OUTPUT_HANDLE); // --share writes nothing to stdout
+    if (stream == INVALID_HANDLE_VALUE) return 1;
+    Utf8Writer out(stream);
+    LoadNtFunctions();
+    if (kill) { const int rc = CliKillTree(killPid, out); return out.Flush() ? rc : 1; }
+
+    const double cores = std::max<DWORD>(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS), 1);
+    std::vector<Proc> v;
+    SampleByKey prev, scratch;
+    SnapshotDiff diff;
+    auto last = std::chrono::steady_clock::now();
+    for (;;) {
+        const auto at = std::chrono::steady_clock::now();
+        Snapshot(v, CollectPaths);
+        DiffSnapshots(prev, scratch, v, diff, prev.empty() ? 0.0 : std::chrono::duration<double>(at - last).count(), cores);
+        last = at;
+        if (share) PublishSnapshot(v);
+        const bool ok = share ? true : fmt == ExportSnapshot ? WriteSnapshot(out, v) : fmt == ExportCsv ? WriteCsv(out, v) : WriteJson(out, v);
+        if (!ok || !out.Flush()) return 1; // reader went away
+        if (every <= 0) return 0;
+        const double left = every - std::chrono::duration<double>(std::chrono::steady_clock::now() - at).count();
+        if (left > 0) Sleep((DWORD)(left * 1000.0));
+    }
+}
+
 // -------------------- Entry Point --------------------
 int APIENTRY wWinMain(_In_ HINSTANCE hInst,
     _In_opt_ HINSTANCE /*hPrev*/,
     _In_ LPWSTR /*lpCmdLine*/,
     _In_ int nShow) {
+    const int rc = RunCommandLine(__argc, __wargv);
+    if (rc >= 0) return rc;
+
     WNDCLASSW wc{ 0 };
     wc.lpfnWndProc = WndProc;
     wc.hInstance = hInst;